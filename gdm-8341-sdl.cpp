@@ -7,8 +7,17 @@
  *
  */
 
+#ifndef HEADLESS
 #include <SDL.h>
 #include <SDL_ttf.h>
+#include <SDL_syswm.h>
+#else
+/*
+ * Headless builds have no SDL at all, this is all the option
+ * parsing needs for the -c colours
+ */
+typedef struct SDL_Color { unsigned char r, g, b, a; } SDL_Color;
+#endif
 
 #include <signal.h>
 #include <stdint.h>
@@ -16,17 +25,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <math.h>
 
+#ifndef HEADLESS
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#endif
 
 #define FL __FILE__,__LINE__
 
@@ -63,6 +89,7 @@ struct mmode_s {
 	char scpi[50];
 	char label[50];
 	char query[50];
+	char conf[50]; // same again without the reading, for mode_switch()
 	char units[10];
 	char logmode[10];
 };
@@ -94,24 +121,74 @@ struct mmode_s {
 #define READSTATE_FINISHED_CONTLIMIT 8
 #define READSTATE_FINISHED_ALL 9
 #define READSTATE_DONE		10
+#define READSTATE_READING_PIPELINE 11
+#define READSTATE_FINISHED_PIPELINE 12
+#define READSTATE_READING_FASTVAL 13
+#define READSTATE_FINISHED_FASTVAL 14
+#define READSTATE_SWITCHING 15 // mode_switch() waiting on FUNC1 in the new function
+#define READSTATE_RESYNC 16 // resync() waiting on the *IDN? sentinel
 #define READSTATE_ERROR 999
 
 #define READ_BUF_SIZE 4096
 
+#define REPLY_TIMEOUT 500000 // us to wait for the meter to answer
+#define REPLY_EACH 20000 // us more for each further reply in a batch
+#define SWITCH_TIMEOUT 1000000 // us for a function change to be answered, relays and all
+#define CMD_RETRIES 2 // times a command is sent again, after a resync, before giving up on the sample
+#define RESYNC_ATTEMPTS 3 // unanswered sentinels before the port is dropped and found again
+#define ERROR_BACKOFF 1000000 // us to wait after a write failure
+#define RECONNECT_BACKSTOP 2000000 // us between reconnect attempts if no hot-plug event turns up
+#define PROBE_SETTLE 200000 // us from a hot-plug event to probing for a meter, one probe per burst of events
+
+/*
+ * What woke an epoll_wait(), in epoll_event.data.u32
+ */
+#define ACQ_SRC_SERIAL 1
+#define ACQ_SRC_TIMER 2
+#define ACQ_SRC_WAKE 3
+#define ACQ_SRC_HOTPLUG 4
+#define ACQ_SRC(src, meter) ((src) | ((meter) << 8)) // serial and timer are per meter
+#define ACQ_SRC_TYPE(u) ((u) & 0xff)
+#define ACQ_METER(u) ((u) >> 8)
+
+#define UI_SRC_XKEYS 10
+#define UI_SRC_SDL 11
+#define UI_SRC_SDL_TICK 12
+#define UI_SRC_WAKE 13
+#define UI_SRC_FRAME 14
+#define UI_SRC_SIGNAL 15
+
+/*
+ * Query modes, how the per-sample set of SCPI queries
+ * is sent to the meter.
+ *
+ * SEQUENTIAL - one query, wait for reply, next query (original)
+ * PIPELINE - all queries written back-to-back in one write()
+ * CHAIN - all queries joined with ';' in one SCPI message
+ *
+ */
+#define QUERYMODE_SEQUENTIAL 0
+#define QUERYMODE_PIPELINE 1
+#define QUERYMODE_CHAIN 2
+
+#define PIPELINE_MAX 40
+#define PIPE_REPLY_SIZE 100
+#define BULK_MAX (PIPELINE_MAX -4) // leave room for FUNC, RANGE, CONT:THR
+
 struct mmode_s mmodes[] = { 
-	{"VOLT", "Volts DC", "MEAS:VOLT:DC?\r\n", "V DC", "VOLTSDC"}, 
-	{"VOLT:AC", "Volts AC", "MEAS:VOLT:AC?\r\n", "V AC", "VOLTSAC"},
-	{"VOLT:DCAC", "Volts DC/AC", "MEAS:VOLT:DCAC?\r\n", "V DC/AC", "VOLTSDC"},
-	{"CURR", "Current DC", "MEAS:CURR:DC?\r\n", "A DC", "AMPSDC"},
-	{"CURR:AC", "Current AC", "MEAS:CURR:AC?\r\n", "A AC", "AMPSAC"},
-	{"CURR:DCAC", "Current DC/AC", "MEAS:CURR:DCAC?\r\n", "A DC/AC", "AMPSDC"},
-	{"RES", "Resistance", "MEAS:RES?\r\n", oo, "OHMS" },
-	{"FREQ", "Frequency", "MEAS:FREQ?\r\n", "Hz", "FREQ" },
-	{"PER", "Period", "MEAS:PER?\r\n", "s", "" },
-	{"TEMP", "Temperature", "MEAS:TEMP:TCO?\r\n", "C", "TEMP"},
-	{"DIOD", "Diode", "MEAS:DIOD?\r\n", "V", "DIODE" },
-	{"CONT", "Continuity", "MEAS:CONT?\r\n", oo, "OHMS" },
-	{"CAP", "Capacitance", "MEAS:CAP?\r\n", "F", "CAP" }
+	{"VOLT", "Volts DC", "MEAS:VOLT:DC?\r\n", "CONF:VOLT:DC\r\n", "V DC", "VOLTSDC"}, 
+	{"VOLT:AC", "Volts AC", "MEAS:VOLT:AC?\r\n", "CONF:VOLT:AC\r\n", "V AC", "VOLTSAC"},
+	{"VOLT:DCAC", "Volts DC/AC", "MEAS:VOLT:DCAC?\r\n", "CONF:VOLT:DCAC\r\n", "V DC/AC", "VOLTSDC"},
+	{"CURR", "Current DC", "MEAS:CURR:DC?\r\n", "CONF:CURR:DC\r\n", "A DC", "AMPSDC"},
+	{"CURR:AC", "Current AC", "MEAS:CURR:AC?\r\n", "CONF:CURR:AC\r\n", "A AC", "AMPSAC"},
+	{"CURR:DCAC", "Current DC/AC", "MEAS:CURR:DCAC?\r\n", "CONF:CURR:DCAC\r\n", "A DC/AC", "AMPSDC"},
+	{"RES", "Resistance", "MEAS:RES?\r\n", "CONF:RES\r\n", oo, "OHMS" },
+	{"FREQ", "Frequency", "MEAS:FREQ?\r\n", "CONF:FREQ\r\n", "Hz", "FREQ" },
+	{"PER", "Period", "MEAS:PER?\r\n", "CONF:PER\r\n", "s", "" },
+	{"TEMP", "Temperature", "MEAS:TEMP:TCO?\r\n", "CONF:TEMP:TCO\r\n", "C", "TEMP"},
+	{"DIOD", "Diode", "MEAS:DIOD?\r\n", "CONF:DIOD\r\n", "V", "DIODE" },
+	{"CONT", "Continuity", "MEAS:CONT?\r\n", "CONF:CONT\r\n", oo, "OHMS" },
+	{"CAP", "Capacitance", "MEAS:CAP?\r\n", "CONF:CAP\r\n", "F", "CAP" }
 };
 
 const char SCPI_FUNC[] = "SENS:FUNC1?\r\n";
@@ -120,13 +197,417 @@ const char SCPI_VAL2[] = "VAL2?\r\n";
 const char SCPI_CONT_THRESHOLD[] = "SENS:CONT:THR?\r\n";
 const char SCPI_LOCAL[] = "SYST:LOC\r\n";
 const char SCPI_RANGE[] = "CONF:RANG?\r\n";
+const char SCPI_RATE[] = "SENS:DET:RATE %c\r\n";
+const char SCPI_IDN[] = "*IDN?\r\n"; // resync() sentinel
 
 const char SEPARATOR_DP[] = ".";
 
+/*
+ * How each CONF:RANG? answer is shown, per function. range is the
+ * reply as a number; readings are multiplied by scale and shown with
+ * int_digits.decimals digits (the meter's 50,000 counts, 5,000 for
+ * capacitance) followed by prefix and mmodes[].units.
+ */
+struct range_s {
+	int mode_index;
+	float range;
+	double scale;
+	int int_digits, decimals;
+	int sign; // leave a column for the sign
+	int ol; // a reading of 5.1E+13 or more is an overload
+	const char *prefix;
+	const char *label;
+};
+
+const struct range_s ranges[] = {
+	{ MMODES_VOLT_DC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mV" },
+	{ MMODES_VOLT_DC, 5, 1, 1, 4, 1, 0, "", "5V" },
+	{ MMODES_VOLT_DC, 50, 1, 2, 3, 1, 0, "", "50V" },
+	{ MMODES_VOLT_DC, 500, 1, 3, 2, 1, 0, "", "500V" },
+	{ MMODES_VOLT_DC, 1000, 1, 4, 1, 1, 0, "", "1000V" },
+
+	{ MMODES_VOLT_AC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mV" },
+	{ MMODES_VOLT_AC, 5, 1, 1, 4, 1, 0, "", "5V" },
+	{ MMODES_VOLT_AC, 50, 1, 2, 3, 1, 0, "", "50V" },
+	{ MMODES_VOLT_AC, 500, 1, 3, 2, 1, 0, "", "500V" },
+	{ MMODES_VOLT_AC, 750, 1, 3, 1, 1, 0, "", "750V" },
+
+	{ MMODES_VOLT_DCAC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mV" },
+	{ MMODES_VOLT_DCAC, 5, 1, 1, 4, 1, 0, "", "5V" },
+	{ MMODES_VOLT_DCAC, 50, 1, 2, 3, 1, 0, "", "50V" },
+	{ MMODES_VOLT_DCAC, 500, 1, 3, 2, 1, 0, "", "500V" },
+	{ MMODES_VOLT_DCAC, 750, 1, 3, 1, 1, 0, "", "750V" },
+
+	{ MMODES_CURR_DC, 0.0005, 1E+6, 3, 2, 1, 0, uu, "500" uu "A" },
+	{ MMODES_CURR_DC, 0.005, 1E+3, 1, 4, 1, 0, "m", "5mA" },
+	{ MMODES_CURR_DC, 0.05, 1E+3, 2, 3, 1, 0, "m", "50mA" },
+	{ MMODES_CURR_DC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mA" },
+	{ MMODES_CURR_DC, 5, 1, 1, 4, 1, 0, "", "5A" },
+	{ MMODES_CURR_DC, 10, 1, 2, 3, 1, 0, "", "10A" },
+
+	{ MMODES_CURR_AC, 0.0005, 1E+6, 3, 2, 1, 0, uu, "500" uu "A" },
+	{ MMODES_CURR_AC, 0.005, 1E+3, 1, 4, 1, 0, "m", "5mA" },
+	{ MMODES_CURR_AC, 0.05, 1E+3, 2, 3, 1, 0, "m", "50mA" },
+	{ MMODES_CURR_AC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mA" },
+	{ MMODES_CURR_AC, 5, 1, 1, 4, 1, 0, "", "5A" },
+	{ MMODES_CURR_AC, 10, 1, 2, 3, 1, 0, "", "10A" },
+
+	{ MMODES_CURR_DCAC, 0.0005, 1E+6, 3, 2, 1, 0, uu, "500" uu "A" },
+	{ MMODES_CURR_DCAC, 0.005, 1E+3, 1, 4, 1, 0, "m", "5mA" },
+	{ MMODES_CURR_DCAC, 0.05, 1E+3, 2, 3, 1, 0, "m", "50mA" },
+	{ MMODES_CURR_DCAC, 0.5, 1E+3, 3, 2, 1, 0, "m", "500mA" },
+	{ MMODES_CURR_DCAC, 5, 1, 1, 4, 1, 0, "", "5A" },
+	{ MMODES_CURR_DCAC, 10, 1, 2, 3, 1, 0, "", "10A" },
+
+	{ MMODES_RES, 50E+1, 1, 3, 2, 0, 1, "", "500" oo },
+	{ MMODES_RES, 50E+2, 1E-3, 1, 4, 0, 1, "k", "5k" oo },
+	{ MMODES_RES, 50E+3, 1E-3, 2, 3, 0, 1, "k", "50k" oo },
+	{ MMODES_RES, 50E+4, 1E-3, 3, 2, 0, 1, "k", "500k" oo },
+	{ MMODES_RES, 50E+5, 1E-6, 1, 4, 0, 1, "M", "5M" oo },
+	{ MMODES_RES, 50E+6, 1E-6, 2, 3, 0, 1, "M", "50M" oo },
+
+	{ MMODES_CAP, 5E-9, 1E+9, 1, 3, 1, 1, "n", "5nF" },
+	{ MMODES_CAP, 5E-8, 1E+9, 2, 2, 1, 1, "n", "50nF" },
+	{ MMODES_CAP, 5E-7, 1E+9, 3, 1, 1, 1, "n", "500nF" },
+	{ MMODES_CAP, 5E-6, 1E+6, 1, 3, 1, 1, uu, "5" uu "F" },
+	{ MMODES_CAP, 5E-5, 1E+6, 2, 2, 1, 1, uu, "50" uu "F" },
+};
+
+#define RANGES_MAX (int)(sizeof(ranges)/sizeof(ranges[0]))
+
 #ifndef PATH_MAX 
 #define PATH_MAX 4096
 #endif
 
+/*
+ * One completed reading, as handed from the acquisition
+ * thread to whoever wants it (currently the renderer)
+ *
+ */
+struct reading_s {
+	uint64_t t; // monotonic, us
+	double v;
+	int meter; // glb.meters[] index
+	int mode_index;
+	int valid; // v is a real reading, not an error placeholder
+	float range; // CONF:RANG? full-scale value
+	char line1[128];
+	char line2[128];
+	char line3[128]; // statistics, empty unless -a
+};
+
+/*
+ * Single-producer / single-consumer lock-free ring of readings.
+ *
+ * head is only ever written by the producer, tail only by the
+ * consumer; RING_SIZE must be a power of two.
+ *
+ */
+#define RING_SIZE 64
+
+struct reading_ring_s {
+	struct reading_s r[RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+};
+
+/*
+ * Streaming statistics, see stats_add()
+ *
+ * Session figures cover everything since the last mode/range
+ * change; each rolling window covers the last span seconds, or
+ * the last WINDOW_SAMPLES readings if that's fewer.
+ */
+#define STATS_WINDOWS_MAX 3
+#define WINDOW_SAMPLES 65536 // must be a power of 2
+
+struct welford_s {
+	uint64_t n;
+	double mean;
+	double m2;
+};
+
+struct stats_window_s {
+	uint64_t span; // us
+	uint64_t *t; // sample ring, WINDOW_SAMPLES long
+	double *v;
+	uint64_t head, tail; // sample sequence numbers
+	uint64_t *minq, *maxq; // monotonic deques of sample sequence numbers
+	uint64_t min_head, min_tail, max_head, max_tail;
+	struct welford_s w;
+};
+
+struct stats_s {
+	int enabled;
+	int mode_index; // what the figures are for, a change resets them
+	float range;
+	struct welford_s all;
+	double min, max;
+	int window_count;
+	struct stats_window_s win[STATS_WINDOWS_MAX];
+};
+
+/*
+ * What the third display line shows, carried with each reading
+ * to the reading server and the logs
+ */
+struct stats_snap_s {
+	uint64_t n;
+	double mean, sd, min, max;
+};
+#define STATS_COLUMNS ",n,mean,sd,min,max,pp"
+
+/*
+ * Capture file, see capture_open()
+ *
+ * [header][chunk 0][chunk 1]...
+ *
+ * Each chunk holds CAP_CHUNK_ROWS readings stored column by
+ * column so a reader can mmap() it and binary search the
+ * timestamps directly. Every chunk starts on a page boundary.
+ */
+#define CAP_MAGIC "GDM8341C"
+#define CAP_VERSION 1
+#define CAP_CHUNK_ROWS 65536
+#define CAP_INDEX_MAX 4096
+#define CAP_HEADER_SIZE (9 *4096)
+#define CAP_T_OFS 0
+#define CAP_V_OFS (CAP_T_OFS +CAP_CHUNK_ROWS *sizeof(uint64_t))
+#define CAP_RANGE_OFS (CAP_V_OFS +CAP_CHUNK_ROWS *sizeof(double))
+#define CAP_MODE_OFS (CAP_RANGE_OFS +CAP_CHUNK_ROWS *sizeof(float))
+#define CAP_CHUNK_SIZE (CAP_MODE_OFS +CAP_CHUNK_ROWS *sizeof(uint8_t))
+
+struct cap_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_rows;
+	uint64_t rows; // written last, after the row's columns
+	uint64_t t0_realtime; // us since the epoch at capture start
+	uint64_t t0; // now_us() at capture start, timestamps are relative to the same clock
+	uint32_t chunks;
+	uint32_t index_max;
+	uint64_t chunk_first_t[CAP_INDEX_MAX]; // chunk index; first timestamp in each chunk
+};
+
+struct capture_s {
+	int fd;
+	struct cap_header_s *hdr;
+	uint8_t *chunk; // the chunk currently being filled
+	uint32_t chunk_no;
+	uint32_t chunk_rows;
+	int full;
+};
+
+/*
+ * Latest reading in POSIX shared memory, see shm_publish()
+ *
+ * A consumer maps the segment read-only and copies it out:
+ *
+ *	do {
+ *		s1 = seq (acquire); if (s1 & 1) retry;
+ *		copy the fields;
+ *		fence (acquire); s2 = seq;
+ *	} while (s1 != s2);
+ *
+ * seq goes up by 2 per reading, so seq/2 counts readings and a
+ * jump of more than 2 between copies means readings were missed.
+ */
+#define SHM_MAGIC 0x38333431 // "8341"
+#define SHM_VERSION 2
+
+struct shm_reading_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq; // odd while an update is in progress
+	uint32_t valid; // 0 when the meter isn't answering, line1 holds "---"
+	uint64_t t; // CLOCK_MONOTONIC us when the reply arrived
+	uint64_t t_realtime; // us since the epoch
+	double v; // raw value as the meter sent it
+	double range; // CONF:RANG? full-scale value
+	int32_t mode_index;
+	char mode[16]; // SCPI function, ie VOLT, RES
+	char logmode[16]; // as written to the -o file
+	char line1[128]; // formatted value as displayed
+	char line2[128]; // mode and range as displayed
+
+	/*
+	 * Statistics as of this reading, when -a is given; windows[]
+	 * are in the order given to -a
+	 */
+	uint32_t stats_enabled;
+	uint32_t window_count;
+	struct {
+		double span; // seconds, 0 for the session
+		uint64_t n;
+		double mean, sd, min, max;
+	} session, windows[STATS_WINDOWS_MAX];
+};
+
+/*
+ * Reading server, see server_thread()
+ *
+ * Every reading goes in to the history ring. Each client is a
+ * cursor in to that ring plus a bounded output queue; the queue
+ * is refilled from the cursor as the socket drains, so replaying
+ * the last -H seconds to a new client and streaming live readings
+ * are the same thing. A client that falls a whole ring behind is
+ * dropped.
+ */
+#define HIST_SIZE 65536 // readings, must be a power of 2
+#define CLIENTS_MAX 32
+#define CLIENT_QUEUE_SIZE 16384
+#define CLIENT_LINE_MAX 256
+
+#define SRV_SRC_UNIX 20
+#define SRV_SRC_TCP 21
+#define SRV_SRC_WAKE 22
+#define SRV_SRC_CLIENT 100 // +client slot
+
+struct hist_entry_s {
+	uint64_t t;
+	double v;
+	float range;
+	uint8_t mode_index;
+	uint8_t meter;
+	struct stats_snap_s stats; // only filled in with -a
+};
+
+struct hist_ring_s {
+	struct hist_entry_s e[HIST_SIZE];
+	uint64_t head; // sequence number of the next reading, written by the acquisition thread
+};
+
+struct client_s {
+	int fd;
+	uint64_t next; // sequence number of the next reading to queue
+	char q[CLIENT_QUEUE_SIZE];
+	size_t q_start, q_end;
+	int want_out; // EPOLLOUT armed
+};
+
+/*
+ * Logging sinks, see log_thread()
+ *
+ * Each sink is another cursor in to the history ring, drained
+ * in batches by the log writer thread every -lf ms.
+ */
+#define SINKS_MAX 4
+#define SINK_BUF_SIZE (256 *1024)
+#define SINK_FORMAT_CSV 0
+#define SINK_FORMAT_JSONL 1
+#define SINK_SYNC_NONE 0
+#define SINK_SYNC_ROTATE 1 // fsync() when a file is rotated or closed
+#define SINK_SYNC_FLUSH 2 // fdatasync() after every batch
+
+#define LOG_SRC_TIMER 30
+#define LOG_SRC_WAKE 31
+
+struct sink_s {
+	int format;
+	char *path; // "-" for stdout
+	int fd;
+	uint64_t next; // sequence number of the next reading to log
+	uint64_t size; // bytes in the current file
+	uint64_t lost; // readings overwritten before we got to them
+	char *buf;
+	size_t len;
+};
+
+/*
+ * Incremental line framer for the meter's replies.
+ *
+ * Bytes from each read() are appended to buf; complete lines are
+ * handed out by framer_next() as views in to buf (the terminating
+ * \r\n is overwritten with \0 so they can be used as C strings).
+ * A view stays valid until the next framer_fill().
+ *
+ */
+struct line_view_s {
+	const char *p;
+	size_t len;
+	uint64_t t; // monotonic us of the read() that completed the line
+};
+
+struct framer_s {
+	char buf[READ_BUF_SIZE];
+	size_t start; // first byte not yet handed out
+	size_t end; // end of received data
+	uint64_t last_read_t;
+
+	// statistics
+	unsigned long reads;
+	unsigned long bytes;
+	unsigned long lines;
+	unsigned long split_reads; // reads that ended part way through a line
+	unsigned long multi_line_reads; // reads that completed more than one line
+	unsigned long overflows; // over-long lines that had to be discarded
+	unsigned int max_lines_per_read;
+	unsigned int lines_this_read;
+};
+
+/*
+ * Benchmark (-B) measurements. rtt[] is only touched by the
+ * acquisition thread and sw[] only by headless_run(); both are
+ * read by bench_report() once those have finished.
+ */
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_SWITCH_US 1000000 // between simulated hotkey presses
+
+struct bench_s {
+	int seconds; // 0 = not benchmarking
+	uint32_t *rtt; // us from query written to its reply line
+	size_t rtt_n;
+	uint32_t *sw; // us from hotkey to first reading in the new mode
+	size_t sw_n;
+	unsigned long readings;
+	unsigned long timeouts;
+	uint64_t first_t, last_t; // first and last published reading
+	struct rusage ru_start;
+};
+
+/*
+ * Metrics, see metrics_thread(). Each is only ever added to, with
+ * relaxed atomics, by the thread doing the work; the metrics thread
+ * reads them the same way, so an export can be a reading or two
+ * behind but never holds anything up.
+ */
+#define METRIC_BUCKETS 15
+#define METRIC_CMD_FUNC 0
+#define METRIC_CMD_VAL1 1
+#define METRIC_CMD_RANGE 2
+#define METRIC_CMD_CONT_THR 3
+#define METRIC_CMD_BATCH 4 // a whole pipe/chain transaction
+#define METRIC_CMDS 5
+
+#define MET_SRC_TIMER 40
+#define MET_SRC_SIGNAL 41
+#define MET_SRC_WAKE 42
+
+const uint64_t metric_bounds[METRIC_BUCKETS] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000 }; // us
+const char *metric_cmd_names[METRIC_CMDS] = { "SENS:FUNC1?", "VAL1?", "CONF:RANG?", "SENS:CONT:THR?", "batch" };
+
+struct metric_hist_s {
+	uint64_t bucket[METRIC_BUCKETS +1]; // not cumulative, the last is +Inf
+	uint64_t sum_us;
+};
+
+struct metrics_s {
+	struct metric_hist_s reply[METRIC_CMDS]; // query written to the reply line
+	struct metric_hist_s reacquire; // each reacquire() attempt
+	struct metric_hist_s render; // UI frame, clear to present
+	struct metric_hist_s mode_switch; // hotkey to the first reading in the new function
+	uint64_t readings;
+	uint64_t reply_timeouts;
+	uint64_t failure_resets; // too many timeouts, port dropped
+	uint64_t port_lost; // EOF/EIO from the port
+	uint64_t reacquires;
+	uint64_t reacquire_failures;
+	uint64_t hotplug_events; // tty nodes coming and going
+	uint64_t cmd_dropped; // outbound command queue full
+	uint64_t resyncs; // in-band resynchronisations
+	uint64_t retries; // commands sent again after one
+};
+
 struct serial_params_s {
 	char device[PATH_MAX];
 	int fd, n;
@@ -135,39 +616,185 @@ struct serial_params_s {
 };
 
 
+/*
+ * Outbound commands, one ring per priority; see cmd_queue()
+ */
+#define CMDQ_SIZE 8 // per priority
+#define CMD_PRI_CONTROL 0 // SYST:LOC on pause and quit
+#define CMD_PRI_USER 1 // hotkey function changes, detection rate
+#define CMD_PRI_POLL 2 // the query state machine
+#define CMD_PRIS 3
+
+struct cmd_s {
+	char text[1024];
+	int len, off; // off bytes of it written so far
+	int replies; // lines the meter answers with, 0 for none
+	uint64_t timeout; // us for those to arrive
+};
+
+struct cmdq_s {
+	struct cmd_s q[CMD_PRIS][CMDQ_SIZE];
+	uint32_t head[CMD_PRIS], tail[CMD_PRIS];
+	struct cmd_s *cur; // part written, goes out before anything else
+	int cur_pri;
+	bool want_out; // EPOLLOUT armed
+};
+
+/*
+ * Everything about one meter; each has its own port and query
+ * state machine, all driven from the one acquisition thread and
+ * only ever touched by it.
+ */
+#define METERS_MAX 4
+
+struct meter_s {
+	int index; // in glb.meters[]
+	char device[PATH_MAX]; // -p, empty to go looking
+	struct serial_params_s serial_params;
+	char usb_serial[64]; // of the port find_port() picked, for the cache
+	uint16_t error_flag;
+	int timer_fd; // reply deadlines and sample pacing
+	uint64_t sample_start;
+	int switch_mode; // function mode_switch() went to, MMODES_MAX once a reading in it is out
+	uint64_t switch_t; // when that was asked for
+	bool switch_synced; // the switch's *IDN? is back, replies from here on are its own
+	bool disconnected; // port gone, waiting on hot-plug (or the backstop timer)
+	bool probe_pending; // timer armed for PROBE_SETTLE, later hot-plug events ride along
+
+	int mode_index;
+	int read_failure;
+	int read_state;
+	uint64_t query_sent; // when the last query went out
+	struct cmdq_s cmdq;
+	struct cmd_s last_cmd; // the last one that wanted a reply, for retrying
+	int last_pri;
+	int retries; // of last_cmd so far
+	int retry_state; // where to pick up once resync() is done, READSTATE_NONE to start afresh
+	struct framer_s framer;
+	struct line_view_s line; // the reply handle_line() last matched
+
+	int pipe_expected; // number of replies the current batch will produce
+	int pipe_received;
+	int pipe_fast; // batch is VAL1? only, function/range from the cache
+	char pipe_reply[PIPELINE_MAX][PIPE_REPLY_SIZE];
+	uint64_t pipe_time[PIPELINE_MAX]; // arrival time of each reply
+
+	int cont_threshold;
+	double v;
+	uint64_t reading_t; // arrival time of the VAL1? reply for v
+	char value[READ_BUF_SIZE];
+	char func[READ_BUF_SIZE];
+	char range[READ_BUF_SIZE];
+
+	/*
+	 * Function/range cache; see decode_range() and the
+	 * READSTATE_FASTVAL path which only polls VAL1?
+	 */
+	int cache_valid;
+	uint64_t cache_time;
+	char range_label[READ_BUF_SIZE];
+	const struct range_s *value_range; // NULL if the range isn't in ranges[]
+	char value_units[50]; // shown after the number
+	int value_ol;
+	float range_value; // range as a number, for the capture file
+
+	struct stats_s stats;
+};
+
 struct glb {
 	uint8_t debug;
 	uint8_t quiet;
 	uint16_t flags;
-	uint16_t error_flag;
 	char *output_file;
-	char device[PATH_MAX];
 
 	int usb_fhandle;
 
 	int comms_mode;
 	char *com_address;
 	char *serial_parameters_string; // this is the raw from the command line
-	struct serial_params_s serial_params; // this is the decoded version
+	char *port_ids; // -pv VID:PID list find_port() will probe, or "any"
+	char port_cache[PATH_MAX]; // where find_port() remembers each meter's port, "" for nowhere
 
-	int mode_index;
-	int read_failure;
-	int read_state;
-	char read_buffer[READ_BUF_SIZE];
-	char *bp;
-	ssize_t bytes_remaining;
+	struct meter_s meters[METERS_MAX];
+	int meter_count;
 
-	int cont_threshold;
-	double v;
-	char value[READ_BUF_SIZE];
-	char func[READ_BUF_SIZE];
-	char range[READ_BUF_SIZE];
+	int query_mode;
+	int bulk_count; // VAL1? queries per transaction
+	char detect_rate; // S, M or F for SENS:DET:RATE, 0 to leave the meter alone
+	int cache_refresh; // ms between full FUNC/RANGE refreshes, 0 = no caching
 
 	int interval;
+	int frame_rate;
+	int trend_readings; // readings across the trend graph, 0 for no graph
+	int headless; // no X/SDL, see headless_run()
 	int font_size;
 	int window_width, window_height;
 	int wx_forced, wy_forced;
 	SDL_Color font_color_pri, font_color_sec, background_color;
+
+	/*
+	 * Shared between the UI and acquisition threads, only
+	 * accessed via the __atomic builtins
+	 */
+	int quit;
+	int paused;
+	int pending_mode; // mmodes[] index the UI wants switched to, -1 for none
+	uint64_t pending_mode_t; // when it was asked for, set before pending_mode
+	int selected_meter; // which meter the hotkeys switch
+
+	struct reading_ring_s display_ring;
+	unsigned int ring_drops;
+
+	/*
+	 * Event loop plumbing, see acquire_thread()
+	 */
+	int acq_epoll;
+	int wake_fd; // UI -> acquisition
+	int ui_wake_fd; // acquisition -> UI, a reading has been published
+	int hotplug_fd; // inotify, /dev and each -p port's directory
+	int hotplug_dev_wd;
+	int acq_paused; // acquisition thread's view of paused
+
+	char *capture_file;
+	struct capture_s capture; // only touched by the acquisition thread
+	char *replay_file;
+	double replay_from, replay_to;
+
+	char *shm_name;
+	struct shm_reading_s *shm;
+
+	/*
+	 * Reading server, see server_thread()
+	 */
+	char *server_unix_path;
+	int server_tcp_port;
+	int replay_seconds; // history sent to new clients
+	int server_epoll;
+	int server_wake_fd;
+	int server_unix_fd, server_tcp_fd;
+	struct client_s *clients;
+
+	/*
+	 * Logging sinks, see log_thread()
+	 */
+	struct sink_s sinks[SINKS_MAX];
+	int sink_count;
+	int sink_flush_ms;
+	uint64_t sink_rotate_bytes; // 0 = never rotate
+	int sink_keep; // rotated files kept
+	int sink_sync;
+	int log_wake_fd;
+
+	struct stats_s stats; // -a settings, each meter gets a copy
+	struct bench_s bench;
+
+	struct metrics_s metrics;
+	char *metrics_file; // Prometheus textfile, NULL for SIGUSR1 only
+	int metrics_interval; // ms between textfile rewrites
+	int metrics_wake_fd;
+
+	struct hist_ring_s *hist; // readings for the server and sinks
+	uint64_t rt_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC, us
 };
 
 /*
@@ -191,6 +818,101 @@ bool fileExists(const char *filename) {
 	return (stat(filename, &buf) == 0);
 }
 
+/*
+ * Monotonic millisecond clock, for timing things
+ * between samples
+ *
+ */
+uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec *1000000 + ts.tv_nsec /1000;
+}
+
+uint64_t now_ms(void) {
+	return now_us() /1000;
+}
+
+/*
+ * set_timer()
+ *
+ * (Re)arms a one-shot timerfd to fire in us microseconds; used for
+ * both reply deadlines and pacing the start of the next sample
+ *
+ */
+void set_timer( int tfd, uint64_t us ) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (us == 0) us = 1; // a zero it_value would disarm it
+	its.it_value.tv_sec = us /1000000;
+	its.it_value.tv_nsec = (us %1000000) *1000;
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+
+/*
+ * wake()
+ *
+ * Pokes an eventfd so whichever loop is waiting on it runs
+ *
+ */
+void wake( int efd ) {
+	uint64_t one = 1;
+	ssize_t r;
+
+	if (efd < 0) return;
+	r = write(efd, &one, sizeof(one));
+	(void)r;
+}
+
+
+/*
+ * watch_fd()
+ *
+ * Adds fd to an epoll set for input, tagged with src so the
+ * loop knows what woke it
+ *
+ */
+int watch_fd( int epfd, int fd, uint32_t src ) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = src;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/*
+ * ring_push() / ring_pop()
+ *
+ * Never block; a push to a full ring is refused (the reading
+ * is dropped) and a pop from an empty ring returns false.
+ *
+ */
+bool ring_push( struct reading_ring_s *q, const struct reading_s *r ) {
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= RING_SIZE) return false;
+	q->r[head & (RING_SIZE -1)] = *r;
+	__atomic_store_n(&q->head, head +1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+bool ring_pop( struct reading_ring_s *q, struct reading_s *r ) {
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head) return false;
+	*r = q->r[tail & (RING_SIZE -1)];
+	__atomic_store_n(&q->tail, tail +1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
 
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
@@ -208,21 +930,94 @@ Comments:
 Changes:
 
 \------------------------------------------------------------------*/
+void meter_init( struct meter_s *m, int index ) {
+	memset(m, 0, sizeof(struct meter_s));
+	m->index = index;
+	m->read_failure = 0;
+	m->read_state = READSTATE_NONE;
+	m->mode_index = MMODES_MAX;
+	m->cont_threshold = 20.0; // ohms
+	m->error_flag = 0;
+	m->device[0] = '\0';
+	m->cache_valid = 0;
+	m->timer_fd = -1;
+	m->disconnected = false;
+	m->switch_mode = MMODES_MAX;
+	memset(&m->cmdq, 0, sizeof(m->cmdq));
+	m->last_cmd.len = 0;
+	m->retries = 0;
+	m->retry_state = READSTATE_NONE;
+	m->serial_params.fd = -1;
+	m->query_sent = 0;
+	m->stats.mode_index = MMODES_MAX;
+}
+
 int init(struct glb *g) {
-	g->read_failure = 0;
-	g->read_state = READSTATE_NONE;
-	g->mode_index = MMODES_MAX;
-	g->cont_threshold = 20.0; // ohms
 	g->debug = 0;
 	g->quiet = 0;
 	g->flags = 0;
-	g->error_flag = 0;
 	g->output_file = NULL;
-	g->interval = 100000; // 100ms / 100,000us interval of sleeping between frames
-	g->device[0] = '\0';
+	g->interval = 100000; // 100ms / 100,000us interval between the start of each sample
+	g->frame_rate = 20;
 	g->comms_mode = CMODE_NONE;
+	g->query_mode = QUERYMODE_SEQUENTIAL;
+	g->bulk_count = 1;
+	g->detect_rate = 0;
+	g->cache_refresh = 0;
+	for (int k = 0; k < METERS_MAX; k++) meter_init( &g->meters[k], k );
+	g->meter_count = 0;
+
+	g->quit = 0;
+	g->paused = 0;
+	g->pending_mode = -1;
+	g->pending_mode_t = 0;
+	g->selected_meter = 0;
+	g->acq_paused = 0;
+	g->acq_epoll = g->wake_fd = g->ui_wake_fd = -1;
+	g->capture_file = NULL;
+	g->capture.fd = -1;
+	g->capture.hdr = NULL;
+	g->replay_file = NULL;
+	g->replay_from = 0;
+	g->replay_to = -1;
+	g->shm_name = NULL;
+	g->shm = NULL;
+	g->server_unix_path = NULL;
+	g->server_tcp_port = 0;
+	g->replay_seconds = 10;
+	g->server_epoll = g->server_wake_fd = -1;
+	g->server_unix_fd = g->server_tcp_fd = -1;
+	g->hist = NULL;
+	g->clients = NULL;
+	g->sink_count = 0;
+	g->sink_flush_ms = 1000;
+	g->sink_rotate_bytes = 0;
+	g->sink_keep = 5;
+	g->sink_sync = SINK_SYNC_NONE;
+	g->log_wake_fd = -1;
+	g->trend_readings = 0;
+	memset(&g->bench, 0, sizeof(g->bench));
+	memset(&g->metrics, 0, sizeof(g->metrics));
+	g->metrics_file = NULL;
+	g->metrics_interval = 10000;
+	g->metrics_wake_fd = -1;
+	g->hotplug_fd = -1;
+	g->hotplug_dev_wd = -1;
+#ifdef HEADLESS
+	g->headless = 1;
+#else
+	g->headless = 0;
+#endif
+	memset(&g->stats, 0, sizeof(g->stats));
+	g->stats.mode_index = MMODES_MAX;
+	g->display_ring.head = g->display_ring.tail = 0;
+	g->ring_drops = 0;
 
 	g->serial_parameters_string = NULL;
+	g->port_ids = (char *)"2184:0030"; // GW Instek GDM-834x, a CP210x underneath
+	if (getenv("XDG_CACHE_HOME")) snprintf(g->port_cache, sizeof(g->port_cache), "%s/gdm-8341-port", getenv("XDG_CACHE_HOME"));
+	else if (getenv("HOME")) snprintf(g->port_cache, sizeof(g->port_cache), "%s/.cache/gdm-8341-port", getenv("HOME"));
+	else g->port_cache[0] = '\0';
 
 	g->font_size = 60;
 	g->window_width = 400;
@@ -247,15 +1042,50 @@ void show_help(void) {
 			"\t-h: This help\r\n"
 			"\t-d: debug enabled\r\n"
 			"\t-q: quiet output\r\n"
+			"\t-n: headless, no window or hotkeys; acquisition and outputs only\r\n"
 			"\t-v: show version\r\n"
 			"\t-z <font size in pt>\r\n"
 			"\t-cv <volts colour, a0a0ff>\r\n"
 			"\t-ca <amps colour, ffffa0>\r\n"
 			"\t-cb <background colour, 101010>\r\n"
-			"\t-t <interval> (sleep delay between samples, default 100,000us)\r\n"
+			"\t-t <interval> (minimum time between samples, default 100,000us)\r\n"
+			"\t-f <fps> display refresh rate (default 20)\r\n"
+			"\t-m <seq|pipe|chain> query mode; one query per round trip (default),\r\n"
+			"\t\tall queries written back-to-back, or all queries ';' chained\r\n"
+			"\t-k <ms> cache function/range and only poll VAL1?, full refresh every <ms>\r\n"
+			"\t-r <slow|medium|fast> set the meter's detection (reading) rate\r\n"
+			"\t-b <count> VAL1? readings fetched per transaction (pipe/chain or -k fast path)\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t\tgive it again for each extra meter, up to 4; 1-4 in the window picks\r\n"
+			"\t\tthe one the hotkeys switch. -o, -C and -M follow the first meter\r\n"
+			"\t-pv <vid:pid>[,<vid:pid>...] USB serial ports probed without -p, or any\r\n"
+			"\t\t(default 2184:0030)\r\n"
+			"\t-pc <file> remember where the meter was found, none to not (default\r\n"
+			"\t\t~/.cache/gdm-8341-port)\r\n"
 			"\t-s <115200|57600|38400|19200|9600> serial speed (default 115200)\r\n"
 			"\t-o <output file>\r\n"
+			"\t-M <name> publish the latest reading in POSIX shared memory, ie /gdm8341\r\n"
+			"\t-g <readings> show a trend graph of the last <readings> readings\r\n"
+			"\t-a <seconds>[,<seconds>...] show running statistics over up to 3 rolling\r\n"
+			"\t\twindows, or 0 for the whole session only; -l, -U and -P lines\r\n"
+			"\t\tcarry n,mean,sd,min,max,pp for the first window\r\n"
+			"\t-l <csv|jsonl>:<file|-> log every reading, may be given up to 4 times\r\n"
+			"\t-lf <ms> log flush interval (default 1000)\r\n"
+			"\t-lr <bytes[k|M|G]> rotate log files at this size (default never)\r\n"
+			"\t-lk <count> rotated log files to keep (default 5)\r\n"
+			"\t-ls <none|rotate|flush> when to fsync log files (default none)\r\n"
+			"\t-U <path> stream readings to clients on a unix socket\r\n"
+			"\t-P <port> stream readings to clients on 127.0.0.1:<port>\r\n"
+			"\t-H <seconds> history replayed to newly connected clients (default 10)\r\n"
+			"\t-C <capture file> record every reading to a binary capture file\r\n"
+			"\t-x <file> keep a Prometheus textfile of metrics, ie for node_exporter;\r\n"
+			"\t\tSIGUSR1 always dumps them to stderr\r\n"
+			"\t-xi <ms> metrics textfile rewrite interval (default 10000)\r\n"
+			"\t-B <seconds> benchmark; run headless, switching function every second,\r\n"
+			"\t\tthen print throughput and latency figures as JSON\r\n"
+			"\t-R <capture file> write a capture file out as CSV and exit\r\n"
+			"\t-S <from>[:<to>] with -R, only readings between these many seconds\r\n"
+			"\t\tinto the capture\r\n"
 			"\r\n"
 			"\texample: gdm-8341-sdl -p /dev/ttyUSB0 -s 38400\r\n"
 			, BUILD_VER
@@ -309,12 +1139,25 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					/*
 					 * com port can be multiple things in linux
 					 * such as /dev/ttySx or /dev/ttyUSBxx
+					 *
+					 * Given more than once, each is another meter
 					 */
 					i++;
-					if (i < argc) {
-						snprintf(g->device, PATH_MAX -1, "%s", argv[i]);
+					if (i < argc && argv[i -1][2] == 'v') {
+						g->port_ids = argv[i];
+
+					} else if (i < argc && argv[i -1][2] == 'c') {
+						if (strcmp(argv[i], "none") == 0) g->port_cache[0] = '\0';
+						else snprintf(g->port_cache, sizeof(g->port_cache), "%s", argv[i]);
+
+					} else if (i < argc) {
+						if (g->meter_count >= METERS_MAX) {
+							fprintf(stdout,"Too many meters, at most %d\n", METERS_MAX);
+							exit(1);
+						}
+						snprintf(g->meters[g->meter_count++].device, PATH_MAX -1, "%s", argv[i]);
 					} else {
-						fprintf(stdout,"Insufficient parameters; -p <usb TMC port ie, /dev/usbtmc2>\n");
+						fprintf(stdout,"Insufficient parameters; -p <usb TMC port ie, /dev/usbtmc2>, -pv <vid:pid>, -pc <file>\n");
 						exit(1);
 					}
 					break;
@@ -338,6 +1181,8 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 				case 'q': g->quiet = 1; break;
 
+				case 'n': g->headless = 1; break;
+
 				case 'v':
 							 fprintf(stdout,"Build %d\r\n", BUILD_VER);
 							 exit(0);
@@ -391,45 +1236,287 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 g->serial_parameters_string = argv[i];
 							 break;
 
-				default: break;
-			} // switch
-		}
-	}
+				case 'f':
+							 i++;
+							 if (i < argc) {
+								 g->frame_rate = atoi(argv[i]);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -f <frames per second>\n");
+								 exit(1);
+							 }
+							 break;
 
-	return 0;
-}
+				case 'r':
+							 i++;
+							 if (i < argc) {
+								 if (strcmp(argv[i], "slow")==0) g->detect_rate = 'S';
+								 else if (strcmp(argv[i], "medium")==0) g->detect_rate = 'M';
+								 else if (strcmp(argv[i], "fast")==0) g->detect_rate = 'F';
+								 else {
+									 fprintf(stdout,"Unknown rate '%s'; -r <slow|medium|fast>\n", argv[i]);
+									 exit(1);
+								 }
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -r <slow|medium|fast>\n");
+								 exit(1);
+							 }
+							 break;
 
+				case 'b':
+							 i++;
+							 if (i < argc) {
+								 g->bulk_count = atoi(argv[i]);
+								 if (g->bulk_count < 1) g->bulk_count = 1;
+								 if (g->bulk_count > BULK_MAX) g->bulk_count = BULK_MAX;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -b <readings per transaction>\n");
+								 exit(1);
+							 }
+							 break;
 
+				case 'k':
+							 i++;
+							 if (i < argc) {
+								 g->cache_refresh = atoi(argv[i]);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -k <refresh ms>\n");
+								 exit(1);
+							 }
+							 break;
 
-/*
- * open_port()
- *
- * The GDM-8341 is fixed in the 8n1 parameters but the
- * serial speed can vary between 9600-115200
- *
- * No flow control
- *
- * Default is 115200
- *
- *
- */
-int open_port( struct glb *g ) {
+				case 'm':
+							 i++;
+							 if (i < argc) {
+								 if (strcmp(argv[i], "seq")==0) g->query_mode = QUERYMODE_SEQUENTIAL;
+								 else if (strcmp(argv[i], "pipe")==0) g->query_mode = QUERYMODE_PIPELINE;
+								 else if (strcmp(argv[i], "chain")==0) g->query_mode = QUERYMODE_CHAIN;
+								 else {
+									 fprintf(stdout,"Unknown query mode '%s'; -m <seq|pipe|chain>\n", argv[i]);
+									 exit(1);
+								 }
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -m <seq|pipe|chain>\n");
+								 exit(1);
+							 }
+							 break;
 
-	struct serial_params_s *s = &(g->serial_params);
-	char *p = g->serial_parameters_string;
-	char default_params[] = "115200";
-	int r; 
+				case 'C':
+							 i++;
+							 if (i < argc) {
+								 g->capture_file = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -C <capture file>\n");
+								 exit(1);
+							 }
+							 break;
 
-	if (!p) p = default_params;
+				case 'M':
+							 i++;
+							 if (i < argc) {
+								 g->shm_name = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -M <shared memory name, ie /gdm8341>\n");
+								 exit(1);
+							 }
+							 break;
 
-	if (g->debug) fprintf(stderr,"%s:%d: Attempting to open '%s'\n", FL, s->device);
-	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
-		return -1;
-	}
+				case 'l':
+							 i++;
+							 if (i >= argc) {
+								 fprintf(stdout,"Insufficient parameters; -l <csv|jsonl>:<file|->, -lf <ms>, -lr <bytes>, -lk <count>, -ls <none|rotate|flush>\n");
+								 exit(1);
+							 }
+							 if (argv[i -1][2] == 'f') {
+								 g->sink_flush_ms = atoi(argv[i]);
+								 if (g->sink_flush_ms < 1) g->sink_flush_ms = 1;
+
+							 } else if (argv[i -1][2] == 'r') {
+								 char *ep;
+								 g->sink_rotate_bytes = strtoull(argv[i], &ep, 10);
+								 if (*ep == 'k' || *ep == 'K') g->sink_rotate_bytes *= 1024;
+								 else if (*ep == 'm' || *ep == 'M') g->sink_rotate_bytes *= 1024 *1024;
+								 else if (*ep == 'g' || *ep == 'G') g->sink_rotate_bytes *= 1024 *1024 *1024ULL;
+
+							 } else if (argv[i -1][2] == 'k') {
+								 g->sink_keep = atoi(argv[i]);
+
+							 } else if (argv[i -1][2] == 's') {
+								 if (strcmp(argv[i], "none")==0) g->sink_sync = SINK_SYNC_NONE;
+								 else if (strcmp(argv[i], "rotate")==0) g->sink_sync = SINK_SYNC_ROTATE;
+								 else if (strcmp(argv[i], "flush")==0) g->sink_sync = SINK_SYNC_FLUSH;
+								 else {
+									 fprintf(stdout,"Unknown sync policy '%s'; -ls <none|rotate|flush>\n", argv[i]);
+									 exit(1);
+								 }
+
+							 } else {
+								 struct sink_s *s;
+								 char *p = strchr(argv[i], ':');
+
+								 if (g->sink_count >= SINKS_MAX) {
+									 fprintf(stdout,"Too many logs, at most %d\n", SINKS_MAX);
+									 exit(1);
+								 }
+								 s = &g->sinks[g->sink_count];
+								 memset(s, 0, sizeof(struct sink_s));
+								 s->fd = -1;
+								 if (p && strncmp(argv[i], "csv:", 4)==0) s->format = SINK_FORMAT_CSV;
+								 else if (p && strncmp(argv[i], "jsonl:", 6)==0) s->format = SINK_FORMAT_JSONL;
+								 else {
+									 fprintf(stdout,"Unknown log '%s'; -l <csv|jsonl>:<file|->\n", argv[i]);
+									 exit(1);
+								 }
+								 s->path = p +1;
+								 g->sink_count++;
+							 }
+							 break;
 
-	r = flock(s->fd, LOCK_EX | LOCK_NB);
+				case 'a':
+							 i++;
+							 if (i < argc) {
+								 char *p = argv[i];
+
+								 g->stats.enabled = 1;
+								 while (*p) {
+									 double span = strtod(p, &p);
+
+									 if (span > 0 && g->stats.window_count < STATS_WINDOWS_MAX) {
+										 g->stats.win[g->stats.window_count++].span = span *1000000;
+									 }
+									 if (*p == ',') p++;
+									 else break;
+								 }
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -a <seconds>[,<seconds>...] (0 for session only)\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'x':
+							 i++;
+							 if (i >= argc) {
+								 fprintf(stdout,"Insufficient parameters; -x <metrics file>, -xi <ms>\n");
+								 exit(1);
+							 }
+							 if (argv[i -1][2] == 'i') {
+								 g->metrics_interval = atoi(argv[i]);
+								 if (g->metrics_interval < 100) g->metrics_interval = 100;
+							 } else {
+								 g->metrics_file = argv[i];
+							 }
+							 break;
+
+				case 'B':
+							 i++;
+							 if (i < argc) {
+								 g->bench.seconds = atoi(argv[i]);
+								 g->headless = 1;
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -B <seconds to run the benchmark for>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'g':
+							 i++;
+							 if (i < argc) {
+								 g->trend_readings = atoi(argv[i]);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -g <readings across the graph>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'U':
+							 i++;
+							 if (i < argc) {
+								 g->server_unix_path = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -U <unix socket path>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'P':
+							 i++;
+							 if (i < argc) {
+								 g->server_tcp_port = atoi(argv[i]);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -P <loopback TCP port>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'H':
+							 i++;
+							 if (i < argc) {
+								 g->replay_seconds = atoi(argv[i]);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -H <seconds of history for new clients>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'R':
+							 i++;
+							 if (i < argc) {
+								 g->replay_file = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -R <capture file>\n");
+								 exit(1);
+							 }
+							 break;
+
+				case 'S':
+							 i++;
+							 if (i < argc) {
+								 char *ep;
+								 g->replay_from = strtod(argv[i], &ep);
+								 if (*ep == ':') g->replay_to = strtod(ep +1, NULL);
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -S <from seconds>[:<to seconds>]\n");
+								 exit(1);
+							 }
+							 break;
+
+				default: break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * open_port()
+ *
+ * The GDM-8341 is fixed in the 8n1 parameters but the
+ * serial speed can vary between 9600-115200
+ *
+ * No flow control
+ *
+ * Default is 115200
+ *
+ *
+ */
+int open_serial( struct glb *g, struct serial_params_s *s ) {
+
+	char *p = g->serial_parameters_string;
+	char default_params[] = "115200";
+	int r; 
+
+	if (!p) p = default_params;
+
+	if (g->debug) fprintf(stderr,"%s:%d: Attempting to open '%s'\n", FL, s->device);
+	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY );
+	if (s->fd <0) {
+		perror( s->device );
+		return -1;
+	}
+
+	r = flock(s->fd, LOCK_EX | LOCK_NB);
 	if (r == -1) {
 		close(s->fd); s->fd = -1;
 		fprintf(stderr, "%s:%d: Unable to set lock on %s, Error '%s'\n", FL, s->device, strerror(errno) );
@@ -472,294 +1559,3503 @@ int open_port( struct glb *g ) {
 	return 0;
 }
 
+int open_port( struct glb *g, struct meter_s *m ) {
+	return open_serial( g, &(m->serial_params) );
+}
+
 #define PORT_OK 0
 #define PORT_CANT_LOCK 10
 #define PORT_INVALID 11
 #define PORT_CANT_SET 12
 #define PORT_NO_SUCCESS -1
 
-int find_port( struct glb *g ) {
+#define PROBE_MAX 16
+#define PROBE_TIMEOUT_US 250000 // *IDN? reply deadline, the meter answers in a few ms
 
-	/*
-		For this multimeter, we actually *want* the read to time out
-		because it means that it's not just spewing out data, ie not
-		a SCPI device
-		*/
-	struct serial_params_s *s = &(g->serial_params);
-	g->read_state = READSTATE_NONE;
-	g->read_failure = 0;
-
-	for ( int port_number = 0; port_number < 10; port_number++ ) {
-		snprintf(s->device, sizeof(s->device) -1, "/dev/ttyUSB%d", port_number);
-		fprintf(stderr,"Testing port %s\n", s->device);
-		int r = open_port( g );
-		if (r == PORT_OK ) {
-			int purge_count = 0;
-			int bytes_read = 0;
-			fd_set set;
-			struct timeval timeout;
-
-			fprintf(stderr,"%s:%d Port %s opened; commence checking data...\n", FL, s->device);
-			FD_ZERO(&set);
-			FD_SET(s->fd, &set);
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 300000; // 0.3 seconds
+struct probe_s {
+	struct serial_params_s sp;
+	char serial[64]; // USB serial number from sysfs, "" if unknown
+	char buf[128];
+	int len;
+};
 
-			{
-				char temp_char = 0;
-				int rv;
 
-				bytes_read = 0;
-				rv = select(s->fd +1, &set, NULL, NULL, &timeout);
-				if (g->debug) fprintf(stderr,"select result = %d\n", rv);
-				if (rv == -1) {
-					break;
-				} else if (rv == 0 ) {
-					// What am I expecting here?
-					//
-				} else { 
-					// Purge the serial buffer
-					// 
-					char buf[1000];
-					bytes_read = read(s->fd, buf, sizeof(buf)-1);
-					buf[bytes_read] = 0;
-					fprintf(stderr,"First read - Content found in buffer, buf[%d] = '%s'\n", bytes_read, buf);
-					if (bytes_read > 0) {
-						bytes_read = read(s->fd, buf, sizeof(buf)-1);
-						buf[bytes_read] = 0;
-						fprintf(stderr,"Second read - Content found in buffer, buf[%d] = '%s'\n", bytes_read, buf);
-					}
-				}
+/*
+ * sysfs_read()
+ *
+ * First line of a sysfs attribute, without the newline
+ *
+ */
+static int sysfs_read( const char *path, char *buf, size_t len ) {
+	FILE *f = fopen(path, "r");
+
+	buf[0] = '\0';
+	if (!f) return -1;
+	if (!fgets(buf, len, f)) buf[0] = '\0';
+	fclose(f);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
 
-				if (g->debug) fprintf(stderr,"%d bytes read after select\n", bytes_read);
-				if (bytes_read > 0) {
-					fprintf(stderr,"%s:%d: %d bytes in queue, not expected since we didn't query\n", FL, bytes_read);
-					close(s->fd);
-					continue;
-					/* 
-						not our meter!
-						*/
-					break;
-				} else if ((rv == 0) && (bytes_read == 0)) {
-					char buf[100];
-
-					if (g->debug) fprintf(stderr,"Testing port with *IDN? query\n");
-					size_t bytes_written = write( s->fd, "*IDN?\r\n", strlen("*IDN?\r\n"));
-					if (bytes_written > 0) {
-						size_t bytes_read = read(s->fd, buf, 99);
-						if (bytes_read > 0) {
-							buf[bytes_read] = '\0';
-							if (g->debug) fprintf(stderr," %ld bytes read, '%s'\n", bytes_read, buf);
-							if (strstr(buf,"GDM8341")) {
-								fprintf(stderr,"Port %s selected\n", s->device);
-								if (g->debug) fprintf(stderr,"Port %s selected\n", s->device);
-								return PORT_OK;
-							}
-						}
-					}
 
-				}
-			} 
+/*
+ * port_usb_id()
+ *
+ * Walks up from the tty's device node in sysfs to the USB device
+ * it hangs off and picks up the VID:PID and serial number
+ *
+ */
+static int port_usb_id( const char *name, char *id, size_t idlen, char *serial, size_t slen ) {
+	char path[PATH_MAX +16], dir[PATH_MAX], vid[8], pid[8];
+
+	if (snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name) >= (int)sizeof(path)) return -1;
+	if (!realpath(path, dir)) return -1;
+
+	for (int up = 0; up < 5; up++) {
+		char *slash;
+
+		if (snprintf(path, sizeof(path), "%s/idVendor", dir) >= (int)sizeof(path)) return -1;
+		if (sysfs_read(path, vid, sizeof(vid)) == 0) {
+			if (snprintf(path, sizeof(path), "%s/idProduct", dir) >= (int)sizeof(path)) return -1;
+			sysfs_read(path, pid, sizeof(pid));
+			snprintf(id, idlen, "%s:%s", vid, pid);
+			if (snprintf(path, sizeof(path), "%s/serial", dir) >= (int)sizeof(path)) return -1;
+			sysfs_read(path, serial, slen);
+			return 0;
+		}
+		slash = strrchr(dir, '/');
+		if (!slash || slash == dir) break;
+		*slash = '\0';
+	}
+	return -1;
+}
 
-			close(s->fd);
-		} // port OK
-	} // for each port
-	return PORT_NO_SUCCESS;
+
+/*
+ * port_id_wanted()
+ *
+ * Is this VID:PID in the -pv list (or is the list "any")
+ *
+ */
+static bool port_id_wanted( glb *g, const char *id ) {
+	const char *p = g->port_ids;
+	size_t l = strlen(id);
+
+	if (strcmp(p, "any") == 0) return true;
+	while (*p) {
+		if (strncasecmp(p, id, l) == 0 && (p[l] == ',' || p[l] == '\0')) return true;
+		p = strchr(p, ',');
+		if (!p) break;
+		p++;
+	}
+	return false;
 }
 
 
+/*
+ * port_candidates()
+ *
+ * USB serial ports whose VID:PID is one we're after. Where sysfs
+ * doesn't list any USB serial ports at all we're back to the old
+ * guess of whichever /dev/ttyUSB0-9 exist.
+ *
+ */
+static int port_candidates( glb *g, struct probe_s *c, int max ) {
+	DIR *d = opendir("/sys/class/tty");
+	struct dirent *de;
+	int n = 0, usb = 0;
+
+	while (d && (de = readdir(d)) && n < max) {
+		char id[20];
+
+		if (strncmp(de->d_name, "ttyUSB", 6) && strncmp(de->d_name, "ttyACM", 6)) continue;
+		usb++;
+		memset(&c[n], 0, sizeof(struct probe_s));
+		if (port_usb_id(de->d_name, id, sizeof(id), c[n].serial, sizeof(c[n].serial)) != 0) continue;
+		if (!port_id_wanted(g, id)) {
+			if (g->debug) fprintf(stderr,"%s:%d: Skipping %s, %s isn't a meter\n", FL, de->d_name, id);
+			continue;
+		}
+		snprintf(c[n].sp.device, sizeof(c[n].sp.device), "/dev/%s", de->d_name);
+		n++;
+	}
+	if (d) closedir(d);
+
+	for (int port_number = 0; usb == 0 && port_number < 10 && n < max; port_number++) {
+		memset(&c[n], 0, sizeof(struct probe_s));
+		snprintf(c[n].sp.device, sizeof(c[n].sp.device), "/dev/ttyUSB%d", port_number);
+		if (access(c[n].sp.device, F_OK) == 0) n++;
+	}
+	return n;
+}
+
 
 /*
- * data_read()
+ * port_cache_read()
  *
- * char *b : buffer for data
- * ssize_t s : size of buffer; function returns if size limit is hit
+ * The cache holds a "<meter> <device> <usb serial>" line for each
+ * meter that find_port() has found
  *
  */
-int data_read( glb *g ) {
-	int bp = 0;
-	ssize_t bytes_read = 0;
-	fd_set set;
-	struct timeval timeout;
+static int port_cache_read( glb *g, char lines[METERS_MAX][PATH_MAX +80] ) {
+	FILE *f;
+	char l[PATH_MAX +80];
+	int count = 0;
+
+	for (int k = 0; k < METERS_MAX; k++) lines[k][0] = '\0';
+	if (!g->port_cache[0]) return 0;
+	f = fopen(g->port_cache, "r");
+	if (!f) return 0;
+	while (fgets(l, sizeof(l), f)) {
+		int k = atoi(l);
+
+		l[strcspn(l, "\r\n")] = '\0';
+		if (k >= 0 && k < METERS_MAX) {
+			snprintf(lines[k], sizeof(lines[k]), "%s", l);
+			count++;
+		}
+	}
+	fclose(f);
+	return count;
+}
 
-	// Non-blocking new code
-	//
-	FD_ZERO(&set);
-	FD_SET(g->serial_params.fd, &set);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 500000; // 0.5 seconds
 
-	g->read_failure++;
+/*
+ * port_cache_save()
+ *
+ * Rewrites this meter's line, leaving the others alone
+ *
+ */
+static void port_cache_save( glb *g, struct meter_s *m ) {
+	char lines[METERS_MAX][PATH_MAX +80];
+	char tfn[PATH_MAX +8];
+	char *slash;
+	FILE *f;
 
-	{ 
-		int rv;
-		bytes_read = 0;
+	if (!g->port_cache[0]) return;
+	port_cache_read( g, lines );
+	snprintf(lines[m->index], sizeof(lines[m->index]), "%d %s %s", m->index, m->serial_params.device, m->usb_serial[0] ? m->usb_serial : "-");
 
-		rv = select(g->serial_params.fd +1, &set, NULL, NULL, &timeout);
-		if (g->debug) fprintf(stderr,"select result = %d\n", rv);
-		if (rv == -1) {
-			return -1;
-			//			break;
-		} else if (rv == 0 ) {
-			// Something bad happens here?
-		} else {
-			bytes_read = read(g->serial_params.fd, g->read_buffer, READ_BUF_SIZE);
-			if (bytes_read > 0) {
-				char *p = strchr(g->read_buffer, '\n');
-				if (p) {
-					*p = 0;
-					g->read_state++;
-					p = strchr(g->read_buffer, '\r');
-					if (p) *p = '\0';
-				}
-				g->read_failure = 0;
+	/*
+	 * ~/.cache might not be there yet
+	 */
+	snprintf(tfn, sizeof(tfn), "%s", g->port_cache);
+	slash = strrchr(tfn, '/');
+	if (slash && slash != tfn) {
+		*slash = '\0';
+		mkdir(tfn, 0700);
+	}
+
+	snprintf(tfn, sizeof(tfn), "%s.tmp", g->port_cache);
+	f = fopen(tfn, "w");
+	if (!f) {
+		if (g->debug) fprintf(stderr,"%s:%d: Unable to write %s (%s)\n", FL, tfn, strerror(errno));
+		return;
+	}
+	for (int k = 0; k < METERS_MAX; k++) {
+		if (lines[k][0]) fprintf(f, "%s\n", lines[k]);
+	}
+	fclose(f);
+	rename(tfn, g->port_cache);
+}
+
+
+/*
+ * probe_ports()
+ *
+ * Opens every candidate, sends them all *IDN? at once and takes
+ * the first that owns up to being a GDM8341 within
+ * PROBE_TIMEOUT_US. Anything already chattering before the query
+ * is flushed, so it'll only get in with a reply that says it's
+ * the meter.
+ *
+ * Returns the index of the winner, still open, or -1.
+ *
+ */
+static int probe_ports( glb *g, struct probe_s *c, int n ) {
+	struct epoll_event evs[PROBE_MAX];
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	int pending = 0, winner = -1;
+	uint64_t deadline;
+
+	if (ep < 0) {
+		fprintf(stderr,"%s:%d: Unable to create probe epoll (%s)\n", FL, strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		c[i].len = 0;
+		if (g->debug) fprintf(stderr,"Testing port %s\n", c[i].sp.device);
+		if (open_serial( g, &c[i].sp ) != PORT_OK) {
+			c[i].sp.fd = -1;
+			continue;
+		}
+		fcntl(c[i].sp.fd, F_SETFL, O_NONBLOCK);
+		tcflush(c[i].sp.fd, TCIOFLUSH);
+		if (write(c[i].sp.fd, "*IDN?\r\n", 7) != 7) {
+			close(c[i].sp.fd); c[i].sp.fd = -1;
+			continue;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, c[i].sp.fd, &ev);
+		pending++;
+	}
+
+	deadline = now_us() +PROBE_TIMEOUT_US;
+	while (winner < 0 && pending > 0) {
+		uint64_t now = now_us();
+		int ready;
+
+		if (now >= deadline) break;
+		ready = epoll_wait(ep, evs, PROBE_MAX, (deadline -now +999) /1000);
+		if (ready < 0 && errno != EINTR) break;
+		for (int e = 0; e < ready && winner < 0; e++) {
+			struct probe_s *p = &c[evs[e].data.u32];
+			ssize_t bytes_read = read(p->sp.fd, p->buf +p->len, sizeof(p->buf) -1 -p->len);
+
+			if (bytes_read > 0) p->len += bytes_read;
+			p->buf[p->len] = '\0';
+			if (strstr(p->buf, "GDM8341")) {
+				winner = evs[e].data.u32;
+				if (g->debug) fprintf(stderr,"%s:%d: %s replied '%s'\n", FL, p->sp.device, p->buf);
+
+			} else if (bytes_read <= 0 || strchr(p->buf, '\n') || p->len >= (int)sizeof(p->buf) -1) {
+				if (g->debug) fprintf(stderr,"%s:%d: %s isn't the meter ('%s')\n", FL, p->sp.device, p->buf);
+				epoll_ctl(ep, EPOLL_CTL_DEL, p->sp.fd, NULL);
+				close(p->sp.fd); p->sp.fd = -1;
+				pending--;
 			}
 		}
+	}
+	close(ep);
 
-	} // New code, non-blocking 
+	for (int i = 0; i < n; i++) {
+		if (i != winner && c[i].sp.fd >= 0) {
+			close(c[i].sp.fd);
+			c[i].sp.fd = -1;
+		}
+	}
 
+	if (winner >= 0) {
+		/*
+		 * Back to blocking, as open_serial() left it, and drop
+		 * whatever's left of the reply
+		 */
+		fcntl(c[winner].sp.fd, F_SETFL, 0);
+		tcflush(c[winner].sp.fd, TCIFLUSH);
+	}
+	return winner;
+}
 
-	// Original blocking code
-	//
-	//
-	/*
-		do {
-		char temp_char;
-		bytes_read = read(g->serial_params.fd, &temp_char, 1);
-		if (bytes_read) {
-	 *(g->bp) = temp_char;
-	 if (*(g->bp) == '\n')  {
-	 g->read_state++; // switch to next read state
-	 *(g->bp) = '\0';
-	 break;
-	 }
-
-	 if (*(g->bp) != '\r') {
-	 if (g->debug) fprintf(stderr,"%c", *(g->bp));
-	 (g->bp)++;
-	 *(g->bp) = '\0';
-	 g->bytes_remaining--;
-	 }
-	 }
-	 } while (bytes_read && g->bytes_remaining > 0);
-	 */
-	//
-	// End of original blocking code
 
-	return bp;
+/*
+ * find_port()
+ *
+ * Goes looking for the meter amongst the USB serial ports with a
+ * matching VID:PID. Whichever port this meter was last found on
+ * (by USB serial number, so a cable bump that renumbers it still
+ * hits) is tried on its own first, then everything else is probed
+ * at once.
+ *
+ */
+int find_port( struct glb *g, struct meter_s *m ) {
+	struct probe_s c[PROBE_MAX];
+	char lines[METERS_MAX][PATH_MAX +80];
+	char cached_dev[PATH_MAX] = "", cached_serial[64] = "";
+	int n, first = -1, winner = -1;
+
+	m->read_state = READSTATE_NONE;
+	m->read_failure = 0;
+	m->serial_params.fd = -1;
+
+	n = port_candidates( g, c, PROBE_MAX );
+
+	port_cache_read( g, lines );
+	if (lines[m->index][0]) {
+		int k;
+		if (sscanf(lines[m->index], "%d %4095s %63s", &k, cached_dev, cached_serial) < 2) cached_dev[0] = '\0';
+		if (strcmp(cached_serial, "-") == 0) cached_serial[0] = '\0';
+	}
+
+	if (cached_dev[0]) {
+		for (int i = 0; i < n && first < 0; i++) {
+			if (cached_serial[0] && strcmp(c[i].serial, cached_serial) == 0) first = i;
+		}
+		for (int i = 0; i < n && first < 0; i++) {
+			if (!cached_serial[0] && strcmp(c[i].sp.device, cached_dev) == 0) first = i;
+		}
+
+		/*
+		 * Not something sysfs told us about (ie the simulator's
+		 * pty), give it a go anyway while it's still there
+		 */
+		if (first < 0 && !cached_serial[0] && n < PROBE_MAX && access(cached_dev, F_OK) == 0) {
+			memset(&c[n], 0, sizeof(struct probe_s));
+			snprintf(c[n].sp.device, sizeof(c[n].sp.device), "%s", cached_dev);
+			first = n++;
+		}
+
+		if (first >= 0 && probe_ports( g, &c[first], 1 ) == 0) {
+			winner = first;
+		} else if (first >= 0) {
+			c[first] = c[--n];
+		}
+	}
+
+	if (winner < 0 && n > 0) winner = probe_ports( g, c, n );
+
+	if (winner < 0) {
+		if (g->debug) fprintf(stderr,"%s:%d: No meter amongst %d candidate ports\n", FL, n);
+		return PORT_NO_SUCCESS;
+	}
+
+	m->serial_params = c[winner].sp;
+	snprintf(m->usb_serial, sizeof(m->usb_serial), "%s", c[winner].serial);
+	fprintf(stderr,"Port %s selected\n", m->serial_params.device);
+	port_cache_save( g, m );
+	return PORT_OK;
 }
 
 
 
 /*
- * data_write()
- *		const char *d : pointer to data to write/send
- *		ssize_t s : number of bytes to send
+ * framer_reset()
+ *
+ * Discards anything buffered, used when we (re)open the port
+ * or deliberately flush the input.
  *
  */
-int data_write( glb *g, const char *d, ssize_t s ) { 
-	ssize_t sz;
+void framer_reset( struct framer_s *fr ) {
+	fr->start = fr->end = 0;
+}
 
-	if (g->serial_params.fd < 1) {
-		fprintf(stderr,"%s:%d: Invalid com port file handle.  Not writing.\n", FL);
-		return -1;
+
+/*
+ * framer_fill()
+ *
+ * One read() from fd appended to the framer buffer.  Any partial
+ * line left over is first shuffled down to the start of the buffer,
+ * which invalidates previously returned views.
+ *
+ * Returns the read() result; 0 is EOF, -1 an error
+ *
+ */
+ssize_t framer_fill( struct framer_s *fr, int fd ) {
+	ssize_t bytes_read;
+
+	if (fr->start > 0) {
+		memmove(fr->buf, fr->buf +fr->start, fr->end -fr->start);
+		fr->end -= fr->start;
+		fr->start = 0;
+	}
+
+	if (fr->end >= sizeof(fr->buf) -1) {
+		/*
+		 * A whole buffer without a line end isn't anything
+		 * the meter would send us, dump it and carry on
+		 */
+		fr->overflows++;
+		fr->end = 0;
 	}
-	if (g->debug) fprintf(stderr,"%s:%d: Sending '%s' [%ld bytes]\n", FL, d, s );
-	sz = write(g->serial_params.fd, d, s); 
-	if (sz < 0) {
-		g->error_flag = true;
-		fprintf(stdout,"Error sending serial data: %s\n", strerror(errno));
+
+	bytes_read = read(fd, fr->buf +fr->end, sizeof(fr->buf) -1 -fr->end);
+	if (bytes_read <= 0) return bytes_read;
+
+	fr->last_read_t = now_us();
+	fr->reads++;
+	fr->bytes += bytes_read;
+	fr->end += bytes_read;
+	fr->lines_this_read = 0;
+	if (fr->buf[fr->end -1] != '\n') fr->split_reads++;
+
+	return bytes_read;
+}
+
+
+/*
+ * framer_next()
+ *
+ * Hands out the next complete line, if there is one.  Blank lines
+ * (such as the \n of a \r\n pair split across reads) are skipped.
+ *
+ */
+bool framer_next( struct framer_s *fr, struct line_view_s *lv ) {
+	while (fr->start < fr->end) {
+		char *p = fr->buf +fr->start;
+		char *eol = (char *)memchr(p, '\n', fr->end -fr->start);
+		size_t len;
+
+		if (!eol) return false;
+
+		fr->start = (eol -fr->buf) +1;
+		*eol = '\0';
+		len = eol -p;
+		while (len && (p[len -1] == '\r' || p[len -1] == '\0')) p[--len] = '\0';
+		if (len == 0) continue;
+
+		lv->p = p;
+		lv->len = len;
+		lv->t = fr->last_read_t;
+
+		fr->lines++;
+		fr->lines_this_read++;
+		if (fr->lines_this_read == 2) fr->multi_line_reads++;
+		if (fr->lines_this_read > fr->max_lines_per_read) fr->max_lines_per_read = fr->lines_this_read;
+
+		return true;
 	}
 
-	return sz;
+	return false;
+}
+
+
+void framer_stats( struct framer_s *fr, FILE *f ) {
+	fprintf(f, "Framing: %lu reads, %lu bytes, %lu lines, %lu split reads, %lu multi-line reads (max %u lines), %lu overflows\n"
+			, fr->reads
+			, fr->bytes
+			, fr->lines
+			, fr->split_reads
+			, fr->multi_line_reads
+			, fr->max_lines_per_read
+			, fr->overflows
+			);
 }
 
 
 /*
- * grab_key()
+ * bench_init() / bench_add() / bench_report()
  *
- * Function sets up a global XGrabKey() and additionally registers
- * for num and cap lock keyboard combinations.
+ * Collects the -B figures; every sample is kept (up to
+ * BENCH_SAMPLES) so the percentiles are exact rather than
+ * bucketed.
  *
  */
-void grab_key(Display* display, Window rootWindow, int keycode, int modifier) {
-	XGrabKey(display, keycode, modifier, rootWindow, false, GrabModeAsync, GrabModeAsync);
+int bench_init( struct bench_s *b ) {
+	b->rtt = (uint32_t *)malloc(BENCH_SAMPLES *sizeof(uint32_t));
+	b->sw = (uint32_t *)malloc(BENCH_SAMPLES *sizeof(uint32_t));
+	if (!b->rtt || !b->sw) {
+		fprintf(stderr,"Unable to allocate the benchmark samples\n");
+		return -1;
+	}
+	getrusage(RUSAGE_SELF, &b->ru_start);
+	return 0;
+}
 
-	if (modifier != AnyModifier) {
-		XGrabKey(display, keycode, modifier | Mod2Mask, rootWindow, false, GrabModeAsync, GrabModeAsync);
-		XGrabKey(display, keycode, modifier | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
-		XGrabKey(display, keycode, modifier | Mod2Mask | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
+void bench_add( uint32_t *a, size_t *n, uint64_t from, uint64_t to ) {
+	if (!a || *n >= BENCH_SAMPLES || to < from) return;
+	a[(*n)++] = (to -from) > UINT32_MAX ? UINT32_MAX : (uint32_t)(to -from);
+}
+
+int bench_cmp( const void *a, const void *b ) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+void bench_percentiles( FILE *f, const char *name, uint32_t *a, size_t n ) {
+	qsort(a, n, sizeof(uint32_t), bench_cmp);
+	fprintf(f, "\"%s\":{\"count\":%zu,\"p50\":%u,\"p99\":%u,\"max\":%u}"
+			, name
+			, n
+			, n ? a[n /2] : 0
+			, n ? a[(n *99) /100] : 0
+			, n ? a[n -1] : 0
+			);
+}
+
+void bench_report( glb *g, FILE *f ) {
+	struct bench_s *b = &g->bench;
+	struct rusage ru;
+	static const char *qm[] = { "seq", "pipe", "chain" };
+	double secs = b->last_t > b->first_t ? (b->last_t -b->first_t) /1e6 : 0;
+	double cpu;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = (ru.ru_utime.tv_sec -b->ru_start.ru_utime.tv_sec) *1e6 +(ru.ru_utime.tv_usec -b->ru_start.ru_utime.tv_usec)
+		+(ru.ru_stime.tv_sec -b->ru_start.ru_stime.tv_sec) *1e6 +(ru.ru_stime.tv_usec -b->ru_start.ru_stime.tv_usec);
+
+	fprintf(f, "{\"query_mode\":\"%s\",\"bulk\":%d,\"cache_ms\":%d,\"interval_us\":%d,\"seconds\":%.3f,\"readings\":%lu,\"readings_per_sec\":%.2f,\"timeouts\":%lu,\"cpu_us_per_reading\":%.2f,"
+			, qm[g->query_mode]
+			, g->bulk_count
+			, g->cache_refresh
+			, g->interval
+			, secs
+			, b->readings
+			, secs > 0 ? (b->readings -1) /secs : 0
+			, b->timeouts
+			, b->readings ? cpu /b->readings : 0
+			);
+	bench_percentiles( f, "rtt_us", b->rtt, b->rtt_n );
+	fprintf(f, ",");
+	bench_percentiles( f, "switch_us", b->sw, b->sw_n );
+	fprintf(f, "}\n");
+
+	free(b->rtt);
+	free(b->sw);
+}
+
+
+/*
+ * metric_inc() / metric_observe() / metric_cmd()
+ *
+ * metric_observe() puts the time between from and to (both
+ * now_us()) in to a histogram; metric_cmd() says which query a
+ * READING_ state is waiting on the reply to.
+ *
+ */
+void metric_inc( uint64_t *c ) {
+	__atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+}
+
+void metric_observe( struct metric_hist_s *h, uint64_t from, uint64_t to ) {
+	uint64_t us;
+	int b;
+
+	if (to < from) return;
+	us = to -from;
+	for (b = 0; b < METRIC_BUCKETS && us > metric_bounds[b]; b++);
+	__atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+}
+
+int metric_cmd( int read_state ) {
+	switch (read_state) {
+		case READSTATE_READING_FUNCTION: return METRIC_CMD_FUNC;
+		case READSTATE_READING_RANGE: return METRIC_CMD_RANGE;
+		case READSTATE_READING_CONTLIMIT: return METRIC_CMD_CONT_THR;
+		default: return METRIC_CMD_VAL1;
 	}
 }
 
 
-/*-----------------------------------------------------------------\
-  Date Code:	: 20180127-220307
-  Function Name	: main
-  Returns Type	: int
-  ----Parameter List
-  1. int argc,
-  2.  char **argv ,
-  ------------------
-  Exit Codes	:
-  Side Effects	:
-  --------------------------------------------------------------------
-Comments:
+/*
+ * cmd_queue() / cmd_flush()
+ *
+ * Everything bound for a meter goes through its cmdq; CONTROL
+ * (SYST:LOC) ahead of USER (function changes, detection rate) ahead
+ * of POLL (the query state machine), though a command part way out
+ * is always finished first so nothing is ever interleaved. The port
+ * is non-blocking; whatever won't go now is picked up again when
+ * epoll says it's writable.
+ *
+ * replies is how many lines the meter will answer with. The reply
+ * deadline is armed at the command's own timeout when it's queued,
+ * so a stuck port still times out, and again once it's all gone
+ * out, which is also when query_sent is stamped.
+ *
+ */
+void cmd_want_out( glb *g, struct meter_s *m, bool on ) {
+	struct epoll_event ev;
+
+	if (m->cmdq.want_out == on || m->serial_params.fd < 0) return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.u32 = ACQ_SRC(ACQ_SRC_SERIAL, m->index);
+	epoll_ctl(g->acq_epoll, EPOLL_CTL_MOD, m->serial_params.fd, &ev);
+	m->cmdq.want_out = on;
+}
+
+bool cmd_pending( struct meter_s *m ) {
+	for (int p = 0; p < CMD_PRIS; p++) {
+		if (m->cmdq.head[p] != m->cmdq.tail[p]) return true;
+	}
+	return false;
+}
+
+void cmd_reset( struct meter_s *m ) {
+	for (int p = 0; p < CMD_PRIS; p++) m->cmdq.head[p] = m->cmdq.tail[p] = 0;
+	m->cmdq.cur = NULL;
+}
+
+void cmd_clear( struct meter_s *m, int pri ) {
+	struct cmdq_s *q = &m->cmdq;
+
+	for (int p = pri; p < CMD_PRIS; p++) {
+		/*
+		 * Leave the one that's part way out, the meter has
+		 * already seen the start of it
+		 */
+		if (q->cur && q->cur == &q->q[p][q->tail[p] % CMDQ_SIZE]) q->head[p] = q->tail[p] +1;
+		else q->head[p] = q->tail[p];
+	}
+}
+
+int cmd_flush( glb *g, struct meter_s *m ) {
+	struct cmdq_s *q = &m->cmdq;
+
+	if (m->serial_params.fd < 0) return -1;
+
+	while (1) {
+		struct cmd_s *c = q->cur;
+		ssize_t sz;
+		int p = 0;
+
+		if (!c) {
+			while (p < CMD_PRIS && q->head[p] == q->tail[p]) p++;
+			if (p == CMD_PRIS) break;
+			c = q->cur = &q->q[p][q->tail[p] % CMDQ_SIZE];
+			q->cur_pri = p;
+			if (g->debug) fprintf(stderr,"%s:%d: Sending '%s' [%d bytes]\n", FL, c->text, c->len );
+		}
+
+		sz = write(m->serial_params.fd, c->text +c->off, c->len -c->off);
+		if (sz < 0 && (errno == EAGAIN || errno == EINTR)) {
+			cmd_want_out( g, m, true );
+			return 0;
+		}
+		if (sz < 0) {
+			m->error_flag = true;
+			fprintf(stdout,"Error sending serial data: %s\n", strerror(errno));
+			cmd_reset( m );
+			cmd_want_out( g, m, false );
+			return -1;
+		}
+		c->off += sz;
+		if (c->off < c->len) {
+			cmd_want_out( g, m, true );
+			return 0;
+		}
+
+		if (c->replies) {
+			m->query_sent = now_us();
+			set_timer( m->timer_fd, c->timeout );
+		}
+		q->tail[q->cur_pri]++;
+		q->cur = NULL;
+	}
+
+	cmd_want_out( g, m, false );
+	return 0;
+}
+
+int cmd_queue( glb *g, struct meter_s *m, int pri, const char *d, size_t s, int replies, uint64_t timeout ) {
+	struct cmdq_s *q = &m->cmdq;
+	struct cmd_s *c;
+
+	if (m->serial_params.fd < 0) {
+		fprintf(stderr,"%s:%d: Invalid com port file handle.  Not writing.\n", FL);
+		return -1;
+	}
+	if (pri == CMD_PRI_POLL && g->acq_paused) return -1; // the front panel is theirs
+	if (q->head[pri] -q->tail[pri] >= CMDQ_SIZE || s >= sizeof(c->text)) {
+		metric_inc( &g->metrics.cmd_dropped );
+		fprintf(stderr,"%s:%d: Command queue full, dropping '%.*s'\n", FL, (int)s, d);
+		return -1;
+	}
+
+	c = &q->q[pri][q->head[pri] % CMDQ_SIZE];
+	memcpy(c->text, d, s);
+	c->text[s] = '\0';
+	c->len = s;
+	c->off = 0;
+	c->replies = replies;
+	c->timeout = timeout;
+	q->head[pri]++;
+	if (replies) set_timer( m->timer_fd, timeout );
+	if (replies && pri != CMD_PRI_CONTROL) {
+		m->last_cmd = *c;
+		m->last_pri = pri;
+	}
+
+	return cmd_flush( g, m );
+}
+
+
+/*
+ * cmd_drain()
+ *
+ * On the way out; give whatever's queued (SYST:LOC) up to
+ * timeout us to get written
+ *
+ */
+void cmd_drain( glb *g, struct meter_s *m, uint64_t timeout ) {
+	uint64_t deadline = now_us() +timeout;
+	struct pollfd pfd;
+
+	pfd.fd = m->serial_params.fd;
+	pfd.events = POLLOUT;
+	while (m->serial_params.fd >= 0 && (m->cmdq.cur || cmd_pending( m ))) {
+		uint64_t now = now_us();
+
+		if (now >= deadline || poll(&pfd, 1, (deadline -now) /1000 +1) <= 0) break;
+		if (cmd_flush( g, m ) < 0) break;
+	}
+}
+
+
+/*
+ * serial_watch()
+ *
+ * A freshly opened port joins the acquisition epoll set; it's
+ * non-blocking from here on, cmd_flush() relies on that
+ *
+ */
+void serial_watch( glb *g, struct meter_s *m ) {
+	fcntl(m->serial_params.fd, F_SETFL, O_NONBLOCK);
+	cmd_reset( m );
+	m->cmdq.want_out = false;
+	watch_fd( g->acq_epoll, m->serial_params.fd, ACQ_SRC(ACQ_SRC_SERIAL, m->index) );
+}
+
+
+/*
+ * pipeline_send()
+ *
+ * Sends the whole per-sample query set as a single write so that
+ * the meter's turn-around time is only paid once per sample rather
+ * than once per query.  In QUERYMODE_PIPELINE the queries are simply
+ * written back-to-back, in QUERYMODE_CHAIN they're joined in to one
+ * SCPI message with ';' (':' resets the command tree path).
+ *
+ * With -b the VAL1? query is repeated bulk_count times, and if
+ * fast is set (function/range cached) only the VAL1?s are sent.
+ *
+ */
+int pipeline_send( glb *g, struct meter_s *m, bool fast ) {
+	const char *q[PIPELINE_MAX];
+	char batch[1024];
+	size_t len = 0;
+	int n = 0;
+
+	if (!fast) q[n++] = SCPI_FUNC;
+	for (int i = 0; i < g->bulk_count; i++) q[n++] = SCPI_VAL1;
+	if (!fast) {
+		q[n++] = SCPI_RANGE;
+		if (m->mode_index == MMODES_CONT) q[n++] = SCPI_CONT_THRESHOLD;
+	}
+
+	for (int i = 0; i < n; i++) {
+		size_t ql = strlen(q[i]);
+
+		if (g->query_mode == QUERYMODE_CHAIN) {
+			ql -= 2; // drop the \r\n, the message gets one terminator at the end
+			if (i) { memcpy(batch +len, ";:", 2); len += 2; }
+		}
+		memcpy(batch +len, q[i], ql);
+		len += ql;
+	}
+	if (g->query_mode == QUERYMODE_CHAIN) { memcpy(batch +len, "\r\n", 2); len += 2; }
+	batch[len] = '\0';
+
+	m->pipe_expected = n;
+	m->pipe_received = 0;
+	m->pipe_fast = fast;
+	m->read_state = READSTATE_READING_PIPELINE;
+
+	return cmd_queue( g, m, CMD_PRI_POLL, batch, len, n, REPLY_TIMEOUT +(n -1) *REPLY_EACH );
+}
+
+
+/*
+ * find_mode()
+ *
+ * Maps the SENS:FUNC1? reply to our mmodes[] index, returns
+ * MMODES_MAX if it's not one we know. Almost every reply is the
+ * function we already had, so that's tried before the table.
+ *
+ */
+int find_mode( glb *g, struct meter_s *m, const char *func ) {
+	int mi;
+
+	if (m->mode_index < MMODES_MAX && strcmp(func, mmodes[m->mode_index].scpi)==0) return m->mode_index;
+
+	for (mi = 0; mi < MMODES_MAX; mi++) {
+		if (func[0] == mmodes[mi].scpi[0] && strcmp(func, mmodes[mi].scpi)==0) {
+			if (g->debug) fprintf(stderr,"%s:%d: HIT on '%s' index %d\n", FL, func, mi);
+			break;
+		}
+	}
+
+	return mi;
+}
+
+
+/*
+ * find_range()
+ *
+ * The ranges[] entry for a function and CONF:RANG? answer, or
+ * NULL if there isn't one
+ *
+ */
+const struct range_s *find_range( int mode_index, float range ) {
+	for (int i = 0; i < RANGES_MAX; i++) {
+		if (ranges[i].mode_index == mode_index && ranges[i].range == range) return &ranges[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * decode_range()
+ *
+ * Works out, once per function/range change, how VAL1? readings
+ * are to be scaled and printed and what the range label looks like.
+ * The result sits in value_range/value_units/range_label so that
+ * the per-sample format_value() only has to do the arithmetic.
+ *
+ */
+void decode_range( struct meter_s *m ) {
+	const struct range_s *rd;
+
+	m->range_value = strtof(m->range, NULL);
+	rd = find_range( m->mode_index, m->range_value );
+
+	m->value_range = rd;
+	m->value_ol = rd ? rd->ol : 0;
+	m->value_units[0] = '\0';
+	if (rd && m->mode_index < MMODES_MAX) snprintf(m->value_units, sizeof(m->value_units), " %s%s", rd->prefix, mmodes[m->mode_index].units);
+
+	switch (m->mode_index) {
+		case MMODES_CONT:
+			snprintf(m->range_label, sizeof(m->range_label), "Threshold: %d%s", m->cont_threshold, oo);
+			break;
+
+		case MMODES_DIOD:
+			snprintf(m->range_label, sizeof(m->range_label), "None");
+			break;
+
+		default:
+			snprintf(m->range_label, sizeof(m->range_label), "%s", rd ? rd->label : m->range);
+			break;
+	}
+}
+
+
+/*
+ * format_fixed()
+ *
+ * v with at least int_digits digits before the point (zero
+ * padded) and exactly decimals after, done in integer arithmetic;
+ * the same as printf's "% 0*.*f" for the sizes we show, without
+ * the cost of parsing a format every sample. Returns the length.
+ *
+ */
+int format_fixed( char *s, size_t len, double v, int int_digits, int decimals, int sign ) {
+	static const uint64_t p10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	char d[24];
+	char *p = s, *e = s +len -1;
+	uint64_t n, ip, fp;
+	int k = 0;
+
+	if (!(fabs(v) < 1E+12) || decimals > 9) return snprintf(s, len, "%f", v);
+
+	n = (uint64_t)(fabs(v) *p10[decimals] +0.5);
+	ip = n /p10[decimals];
+	fp = n %p10[decimals];
+
+	if (v < 0 && n) { if (p < e) *p++ = '-'; }
+	else if (sign) { if (p < e) *p++ = ' '; }
+
+	do { d[k++] = '0' +ip %10; ip /= 10; } while (ip);
+	while (k < int_digits) d[k++] = '0';
+	while (k && p < e) *p++ = d[--k];
+
+	if (decimals && p < e) *p++ = '.';
+	for (int i = decimals -1; i >= 0 && p < e; i--) {
+		*p++ = '0' +(fp /p10[i]) %10;
+	}
+	*p = '\0';
+
+	return p -s;
+}
+
+
+/*
+ * format_value()
+ *
+ * Per-sample formatting of g->v in to g->value using the
+ * range decided by decode_range()
+ *
+ */
+void format_value( struct meter_s *m ) {
+	const struct range_s *rd = m->value_range;
+
+	switch (m->mode_index) {
+		case MMODES_CONT:
+			if (m->v > m->cont_threshold) {
+				if (m->v > 1000) m->v = 999.9;
+				snprintf(m->value, sizeof(m->value), "OPEN [%05.1f%s]", m->v, oo);
+			}
+			else {
+				snprintf(m->value, sizeof(m->value), "SHRT [%05.1f%s]", m->v, oo);
+			}
+			break;
+
+		case MMODES_DIOD:
+			if (m->v > 9.999) {
+				snprintf(m->value, sizeof(m->value), "OL / OPEN");
+			} else {
+				snprintf(m->value, sizeof(m->value), "%06.4f V", m->v);
+			}
+			break;
+
+		default:
+			if (m->value_ol && m->v >= 51000000000000) {
+				snprintf(m->value, sizeof(m->value), "OL");
+			} else if (rd) {
+				int n = format_fixed( m->value, sizeof(m->value), m->v *rd->scale, rd->int_digits, rd->decimals, rd->sign );
+				snprintf(m->value +n, sizeof(m->value) -n, "%s", m->value_units);
+			} else {
+				snprintf(m->value, sizeof(m->value), "%f", m->v);
+			}
+			break;
+	}
+}
+
+
+/*
+ * config_refreshed()
+ *
+ * Called once a full FUNC/VAL1/RANGE cycle has completed; the
+ * function and range are now known so they can be decoded and
+ * cached for the VAL1?-only fast path.
+ *
+ */
+void config_refreshed( struct meter_s *m ) {
+	decode_range( m );
+	m->cache_valid = 1;
+	m->cache_time = now_ms();
+}
+
+
+/*
+ * cache_fresh()
+ *
+ * True when caching is enabled and the cached function/range
+ * are still within the -k refresh period
+ *
+ */
+bool cache_fresh( glb *g, struct meter_s *m ) {
+	if (g->cache_refresh <= 0 || !m->cache_valid) return false;
+	return (now_ms() - m->cache_time) < (uint64_t)g->cache_refresh;
+}
+
+
+/*
+ * capture_open()
+ *
+ * Starts a new capture file, truncating any existing one. The
+ * header stays mapped for the life of the capture, chunks are
+ * mapped one at a time as they fill.
+ *
+ */
+int capture_open( struct capture_s *c, const char *fn ) {
+	struct timespec ts;
+
+	memset(c, 0, sizeof(struct capture_s));
+	c->fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		fprintf(stderr,"Can't open capture file '%s' (%s)\n", fn, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(c->fd, CAP_HEADER_SIZE) != 0) {
+		fprintf(stderr,"Can't size capture file '%s' (%s)\n", fn, strerror(errno));
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+
+	c->hdr = (struct cap_header_s *)mmap(NULL, CAP_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->hdr == MAP_FAILED) {
+		fprintf(stderr,"Can't map capture file '%s' (%s)\n", fn, strerror(errno));
+		close(c->fd);
+		c->fd = -1;
+		c->hdr = NULL;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(c->hdr->magic, CAP_MAGIC, sizeof(c->hdr->magic));
+	c->hdr->version = CAP_VERSION;
+	c->hdr->chunk_rows = CAP_CHUNK_ROWS;
+	c->hdr->index_max = CAP_INDEX_MAX;
+	c->hdr->t0_realtime = (uint64_t)ts.tv_sec *1000000 +ts.tv_nsec /1000;
+	c->hdr->t0 = now_us();
+
+	return 0;
+}
+
+
+/*
+ * capture_add()
+ *
+ * Appends one reading. The row count in the header is only
+ * bumped once the row's columns are in place so a reader that
+ * has the file mapped at the same time never sees a torn row.
+ *
+ */
+void capture_add( struct capture_s *c, uint64_t t, double v, int mode_index, float range ) {
+	if (!c->hdr || c->full) return;
+
+	if (!c->chunk || c->chunk_rows == CAP_CHUNK_ROWS) {
+		if (c->chunk) {
+			msync(c->chunk, CAP_CHUNK_SIZE, MS_ASYNC);
+			munmap(c->chunk, CAP_CHUNK_SIZE);
+			c->chunk = NULL;
+			c->chunk_no++;
+		}
+
+		if (c->chunk_no >= CAP_INDEX_MAX
+				|| ftruncate(c->fd, CAP_HEADER_SIZE +(off_t)(c->chunk_no +1) *CAP_CHUNK_SIZE) != 0) {
+			fprintf(stderr,"Capture file full or unable to grow it, capture stopped at %lu readings\n", (unsigned long)c->hdr->rows);
+			c->full = 1;
+			return;
+		}
+
+		c->chunk = (uint8_t *)mmap(NULL, CAP_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, CAP_HEADER_SIZE +(off_t)c->chunk_no *CAP_CHUNK_SIZE);
+		if (c->chunk == MAP_FAILED) {
+			fprintf(stderr,"Unable to map capture chunk %u (%s), capture stopped\n", c->chunk_no, strerror(errno));
+			c->chunk = NULL;
+			c->full = 1;
+			return;
+		}
+		c->chunk_rows = 0;
+		c->hdr->chunk_first_t[c->chunk_no] = t;
+		c->hdr->chunks = c->chunk_no +1;
+	}
+
+	((uint64_t *)(c->chunk +CAP_T_OFS))[c->chunk_rows] = t;
+	((double *)(c->chunk +CAP_V_OFS))[c->chunk_rows] = v;
+	((float *)(c->chunk +CAP_RANGE_OFS))[c->chunk_rows] = range;
+	((uint8_t *)(c->chunk +CAP_MODE_OFS))[c->chunk_rows] = mode_index;
+	c->chunk_rows++;
+
+	__atomic_store_n(&c->hdr->rows, c->hdr->rows +1, __ATOMIC_RELEASE);
+}
+
+
+void capture_close( struct capture_s *c ) {
+	if (c->chunk) munmap(c->chunk, CAP_CHUNK_SIZE);
+	if (c->hdr) {
+		msync(c->hdr, CAP_HEADER_SIZE, MS_SYNC);
+		munmap(c->hdr, CAP_HEADER_SIZE);
+	}
+	if (c->fd >= 0) close(c->fd);
+	c->chunk = NULL;
+	c->hdr = NULL;
+	c->fd = -1;
+}
+
+
+/*
+ * capture_replay()
+ *
+ * Maps a capture file and writes the readings between from and
+ * to (seconds since the capture started, to < 0 for the end) to
+ * stdout as CSV. The chunk index finds the first chunk and a
+ * binary search of its timestamp column finds the first row, so
+ * the cost doesn't depend on how far into the file the slice is.
+ *
+ */
+int capture_replay( const char *fn, double from, double to ) {
+	struct stat st;
+	const struct cap_header_s *h;
+	const uint8_t *base;
+	uint64_t rows, t_from, t_to, row;
+	uint32_t chunks, lo, hi;
+	int fd;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < CAP_HEADER_SIZE) {
+		fprintf(stderr,"Can't open capture file '%s'\n", fn);
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+
+	base = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr,"Can't map capture file '%s' (%s)\n", fn, strerror(errno));
+		return 1;
+	}
+
+	h = (const struct cap_header_s *)base;
+	if (memcmp(h->magic, CAP_MAGIC, sizeof(h->magic)) != 0 || h->version != CAP_VERSION || h->chunk_rows != CAP_CHUNK_ROWS) {
+		fprintf(stderr,"'%s' is not a capture file this build can read\n", fn);
+		munmap((void *)base, st.st_size);
+		return 1;
+	}
+
+	/*
+	 * The file might still be being written; only trust the rows
+	 * the writer had finished when we looked, and only the chunks
+	 * the file is actually long enough to hold.
+	 */
+	rows = __atomic_load_n(&h->rows, __ATOMIC_ACQUIRE);
+	chunks = (rows +CAP_CHUNK_ROWS -1) /CAP_CHUNK_ROWS;
+	if (chunks > (st.st_size -CAP_HEADER_SIZE) /CAP_CHUNK_SIZE) {
+		chunks = (st.st_size -CAP_HEADER_SIZE) /CAP_CHUNK_SIZE;
+		rows = (uint64_t)chunks *CAP_CHUNK_ROWS;
+	}
+
+	t_from = h->t0 +(uint64_t)(from *1000000);
+	t_to = to < 0 ? UINT64_MAX : h->t0 +(uint64_t)(to *1000000);
+
+	/*
+	 * Last chunk starting at or before t_from
+	 */
+	lo = 0; hi = chunks;
+	while (hi -lo > 1) {
+		uint32_t mid = (lo +hi) /2;
+		if (h->chunk_first_t[mid] <= t_from) lo = mid; else hi = mid;
+	}
+
+	/*
+	 * First row in that chunk at or after t_from
+	 */
+	row = (uint64_t)lo *CAP_CHUNK_ROWS;
+	if (chunks) {
+		const uint64_t *t = (const uint64_t *)(base +CAP_HEADER_SIZE +(size_t)lo *CAP_CHUNK_SIZE +CAP_T_OFS);
+		uint64_t n = rows -row < CAP_CHUNK_ROWS ? rows -row : CAP_CHUNK_ROWS;
+		uint64_t a = 0, b = n;
+
+		while (a < b) {
+			uint64_t mid = (a +b) /2;
+			if (t[mid] < t_from) a = mid +1; else b = mid;
+		}
+		row += a;
+	}
+
+	fprintf(stdout,"# start %lu.%06lu, %lu readings\n"
+			, (unsigned long)(h->t0_realtime /1000000)
+			, (unsigned long)(h->t0_realtime %1000000)
+			, (unsigned long)h->rows
+			);
+	fprintf(stdout,"seconds,value,mode,range\n");
+
+	for (; row < rows; row++) {
+		const uint8_t *chunk = base +CAP_HEADER_SIZE +(size_t)(row /CAP_CHUNK_ROWS) *CAP_CHUNK_SIZE;
+		uint32_t k = row %CAP_CHUNK_ROWS;
+		uint64_t t = ((const uint64_t *)(chunk +CAP_T_OFS))[k];
+		int mi = ((const uint8_t *)(chunk +CAP_MODE_OFS))[k];
+
+		if (t > t_to) break;
+		fprintf(stdout,"%.6f,%.8g,%s,%g\n"
+				, (t -h->t0) /1000000.0
+				, ((const double *)(chunk +CAP_V_OFS))[k]
+				, mi < MMODES_MAX ? mmodes[mi].scpi : "?"
+				, ((const float *)(chunk +CAP_RANGE_OFS))[k]
+				);
+	}
+
+	munmap((void *)base, st.st_size);
+
+	return 0;
+}
+
+
+/*
+ * welford_add() / welford_remove()
+ *
+ * Running mean and sum of squared differences; removal is the
+ * same update run backwards, which is what lets a rolling window
+ * stay O(1) per reading.
+ *
+ */
+void welford_add( struct welford_s *w, double x ) {
+	double d = x -w->mean;
+
+	w->n++;
+	w->mean += d /w->n;
+	w->m2 += d *(x -w->mean);
+}
+
+void welford_remove( struct welford_s *w, double x ) {
+	double d;
+
+	if (w->n <= 1) {
+		memset(w, 0, sizeof(struct welford_s));
+		return;
+	}
+
+	d = x -w->mean;
+	w->mean -= d /(w->n -1);
+	w->m2 -= d *(x -w->mean);
+	if (w->m2 < 0) w->m2 = 0;
+	w->n--;
+}
+
+double welford_sd( struct welford_s *w ) {
+	return w->n > 1 ? sqrt(w->m2 /(w->n -1)) : 0.0;
+}
+
+
+/*
+ * stats_init()
+ *
+ * Allocates the window rings for the spans given with -a.
+ *
+ */
+int stats_init( struct stats_s *st ) {
+	for (int k = 0; k < st->window_count; k++) {
+		struct stats_window_s *sw = &st->win[k];
+
+		sw->t = (uint64_t *)calloc(WINDOW_SAMPLES, sizeof(uint64_t));
+		sw->v = (double *)calloc(WINDOW_SAMPLES, sizeof(double));
+		sw->minq = (uint64_t *)calloc(WINDOW_SAMPLES, sizeof(uint64_t));
+		sw->maxq = (uint64_t *)calloc(WINDOW_SAMPLES, sizeof(uint64_t));
+		if (!sw->t || !sw->v || !sw->minq || !sw->maxq) {
+			fprintf(stderr,"Unable to allocate statistics windows\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+void stats_free( struct stats_s *st ) {
+	for (int k = 0; k < st->window_count; k++) {
+		free(st->win[k].t);
+		free(st->win[k].v);
+		free(st->win[k].minq);
+		free(st->win[k].maxq);
+	}
+}
+
+
+void stats_reset( struct stats_s *st, int mode_index, float range ) {
+	st->mode_index = mode_index;
+	st->range = range;
+	memset(&st->all, 0, sizeof(st->all));
+	st->min = st->max = 0;
+	for (int k = 0; k < st->window_count; k++) {
+		struct stats_window_s *sw = &st->win[k];
+
+		sw->head = sw->tail = 0;
+		sw->min_head = sw->min_tail = sw->max_head = sw->max_tail = 0;
+		memset(&sw->w, 0, sizeof(sw->w));
+	}
+}
+
+
+/*
+ * stats_add()
+ *
+ * Feeds one reading through the session figures and every
+ * window. Each window evicts whatever has aged out, then the
+ * min/max deques drop anything the new reading dominates; each
+ * sample goes in and out of each deque at most once.
+ *
+ */
+void stats_add( struct stats_s *st, int mode_index, float range, uint64_t t, double v ) {
+	if (!st->enabled) return;
+
+	if (mode_index != st->mode_index || range != st->range) stats_reset( st, mode_index, range );
+
+	welford_add( &st->all, v );
+	if (st->all.n == 1 || v < st->min) st->min = v;
+	if (st->all.n == 1 || v > st->max) st->max = v;
+
+	for (int k = 0; k < st->window_count; k++) {
+		struct stats_window_s *sw = &st->win[k];
+		const uint64_t m = WINDOW_SAMPLES -1;
+
+		while (sw->head > sw->tail && (sw->head -sw->tail >= WINDOW_SAMPLES || t -sw->t[sw->tail & m] > sw->span)) {
+			welford_remove( &sw->w, sw->v[sw->tail & m] );
+			if (sw->min_tail > sw->min_head && sw->minq[sw->min_head & m] == sw->tail) sw->min_head++;
+			if (sw->max_tail > sw->max_head && sw->maxq[sw->max_head & m] == sw->tail) sw->max_head++;
+			sw->tail++;
+		}
+
+		sw->t[sw->head & m] = t;
+		sw->v[sw->head & m] = v;
+		welford_add( &sw->w, v );
+
+		while (sw->min_tail > sw->min_head && sw->v[sw->minq[(sw->min_tail -1) & m] & m] >= v) sw->min_tail--;
+		sw->minq[sw->min_tail++ & m] = sw->head;
+		while (sw->max_tail > sw->max_head && sw->v[sw->maxq[(sw->max_tail -1) & m] & m] <= v) sw->max_tail--;
+		sw->maxq[sw->max_tail++ & m] = sw->head;
+
+		sw->head++;
+	}
+}
+
+
+double stats_window_min( struct stats_window_s *sw ) {
+	return sw->min_tail > sw->min_head ? sw->v[sw->minq[sw->min_head & (WINDOW_SAMPLES -1)] & (WINDOW_SAMPLES -1)] : 0.0;
+}
+
+double stats_window_max( struct stats_window_s *sw ) {
+	return sw->max_tail > sw->max_head ? sw->v[sw->maxq[sw->max_head & (WINDOW_SAMPLES -1)] & (WINDOW_SAMPLES -1)] : 0.0;
+}
+
+
+/*
+ * stats_snap()
+ *
+ * The figures the third display line is made from; the first -a
+ * window if there is one, otherwise the session.
+ *
+ */
+void stats_snap( struct stats_s *st, struct stats_snap_s *ss ) {
+	if (st->window_count) {
+		struct stats_window_s *sw = &st->win[0];
+
+		ss->n = sw->w.n;
+		ss->mean = sw->w.mean;
+		ss->sd = welford_sd( &sw->w );
+		ss->min = stats_window_min( sw );
+		ss->max = stats_window_max( sw );
+	} else {
+		ss->n = st->all.n;
+		ss->mean = st->all.mean;
+		ss->sd = welford_sd( &st->all );
+		ss->min = st->min;
+		ss->max = st->max;
+	}
+}
+
+
+/*
+ * stats_fields()
+ *
+ * A reading's STATS_COLUMNS for the reading server and CSV logs
+ *
+ */
+int stats_fields( char *s, size_t len, const struct stats_snap_s *ss ) {
+	return snprintf(s, len, ",%lu,%.10g,%.4g,%.10g,%.10g,%.4g"
+			, (unsigned long)ss->n
+			, ss->mean
+			, ss->sd
+			, ss->min
+			, ss->max
+			, ss->max -ss->min
+			);
+}
+
+
+/*
+ * stats_line()
+ *
+ * The third display line; the first -a window if there is one,
+ * otherwise the session figures.
+ *
+ */
+void stats_line( struct stats_s *st, char *s, size_t len ) {
+	if (!st->enabled || st->mode_index >= MMODES_MAX) {
+		s[0] = '\0';
+		return;
+	}
+
+	if (st->window_count) {
+		struct stats_window_s *sw = &st->win[0];
+
+		snprintf(s, len, "%gs avg %.6g sd %.2g pp %.3g"
+				, sw->span /1000000.0
+				, sw->w.mean
+				, welford_sd( &sw->w )
+				, stats_window_max( sw ) -stats_window_min( sw )
+				);
+	} else {
+		snprintf(s, len, "all avg %.6g sd %.2g pp %.3g"
+				, st->all.mean
+				, welford_sd( &st->all )
+				, st->max -st->min
+				);
+	}
+}
+
+
+/*
+ * shm_open_reading()
+ *
+ * Creates (or takes over) the shared memory segment. The
+ * segment is removed again by shm_close_reading().
+ *
+ */
+struct shm_reading_s *shm_open_reading( const char *name ) {
+	struct shm_reading_s *s;
+	int fd;
+
+	fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr,"Can't create shared memory segment '%s' (%s)\n", name, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(struct shm_reading_s)) != 0) {
+		fprintf(stderr,"Can't size shared memory segment '%s' (%s)\n", name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	s = (struct shm_reading_s *)mmap(NULL, sizeof(struct shm_reading_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		fprintf(stderr,"Can't map shared memory segment '%s' (%s)\n", name, strerror(errno));
+		return NULL;
+	}
+
+	/*
+	 * A segment left behind by an earlier run keeps its sequence
+	 * number going so consumers don't see it jump backwards; we
+	 * just make sure it's even.
+	 */
+	if (s->magic != SHM_MAGIC || s->version != SHM_VERSION) memset(s, 0, sizeof(struct shm_reading_s));
+	s->seq &= ~1U;
+	s->magic = SHM_MAGIC;
+	s->version = SHM_VERSION;
+
+	return s;
+}
+
+
+void shm_close_reading( struct shm_reading_s *s, const char *name ) {
+	if (!s) return;
+	munmap(s, sizeof(struct shm_reading_s));
+	shm_unlink(name);
+}
+
+
+/*
+ * shm_publish()
+ *
+ * Seqlock writer; there's only ever the one writer, the
+ * acquisition thread, so no lock is needed on this side.
+ *
+ */
+void shm_publish( struct shm_reading_s *s, struct meter_s *m, const struct reading_s *r ) {
+	struct timespec ts;
+	uint32_t seq;
+
+	if (!s) return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->seq, seq +1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	s->valid = m->cache_valid;
+	s->t = r->t;
+	s->t_realtime = (uint64_t)ts.tv_sec *1000000 +ts.tv_nsec /1000;
+	s->v = r->v;
+	s->range = m->range_value;
+	s->mode_index = r->mode_index;
+	snprintf(s->mode, sizeof(s->mode), "%.15s", r->mode_index < MMODES_MAX ? mmodes[r->mode_index].scpi : "");
+	snprintf(s->logmode, sizeof(s->logmode), "%.15s", r->mode_index < MMODES_MAX ? mmodes[r->mode_index].logmode : "");
+	memcpy(s->line1, r->line1, sizeof(s->line1));
+	memcpy(s->line2, r->line2, sizeof(s->line2));
+
+	s->stats_enabled = m->stats.enabled;
+	if (m->stats.enabled) {
+		s->session.span = 0;
+		s->session.n = m->stats.all.n;
+		s->session.mean = m->stats.all.mean;
+		s->session.sd = welford_sd( &m->stats.all );
+		s->session.min = m->stats.min;
+		s->session.max = m->stats.max;
+		s->window_count = m->stats.window_count;
+		for (int k = 0; k < m->stats.window_count; k++) {
+			struct stats_window_s *sw = &m->stats.win[k];
+
+			s->windows[k].span = sw->span /1000000.0;
+			s->windows[k].n = sw->w.n;
+			s->windows[k].mean = sw->w.mean;
+			s->windows[k].sd = welford_sd( &sw->w );
+			s->windows[k].min = stats_window_min( sw );
+			s->windows[k].max = stats_window_max( sw );
+		}
+	}
+
+	__atomic_store_n(&s->seq, seq +2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * hist_push()
+ *
+ * Single writer, the acquisition thread. The slot is written
+ * before head moves past it; a reader that finds head has since
+ * moved a whole ring past what it copied knows the copy may be
+ * torn.
+ *
+ */
+void hist_push( struct hist_ring_s *h, int server_wake_fd, uint64_t t, double v, int meter, int mode_index, float range, const struct stats_snap_s *ss ) {
+	uint64_t head;
+	struct hist_entry_s *e;
+
+	if (!h) return;
+
+	head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+	e = &h->e[head & (HIST_SIZE -1)];
+	e->t = t;
+	e->v = v;
+	e->range = range;
+	e->mode_index = mode_index;
+	e->meter = meter;
+	e->stats = *ss;
+	__atomic_store_n(&h->head, head +1, __ATOMIC_RELEASE);
+	wake( server_wake_fd );
+}
+
+
+/*
+ * publish_reading()
+ *
+ * Formats the current g->v and hands it, stamped with the
+ * time its reply arrived, to the display.
+ *
+ */
+void publish_reading( glb *g, struct meter_s *m ) {
+	struct reading_s r;
+
+	if (m->cache_valid) format_value( m );
+
+	r.t = m->reading_t;
+	r.v = m->v;
+	r.meter = m->index;
+	r.mode_index = m->mode_index;
+	r.valid = m->cache_valid;
+	r.range = m->range_value;
+	snprintf(r.line1, sizeof(r.line1), "%.*s", (int)sizeof(r.line1) -1, m->value);
+	snprintf(r.line2, sizeof(r.line2), "%s, %.*s", m->mode_index < MMODES_MAX ? mmodes[m->mode_index].label : "", (int)sizeof(r.line2) /2, m->range_label);
+	if (m->cache_valid) stats_add( &m->stats, m->mode_index, m->range_value, r.t, m->v );
+	if (m->cache_valid && m->switch_mode == m->mode_index) {
+		metric_observe( &g->metrics.mode_switch, m->switch_t, now_us() );
+		m->switch_mode = MMODES_MAX;
+	}
+	stats_line( &m->stats, r.line3, sizeof(r.line3) );
+	if (!ring_push( &g->display_ring, &r )) g->ring_drops++;
+	wake( g->ui_wake_fd );
+	if (m->index == 0) shm_publish( g->shm, m, &r );
+	metric_inc( &g->metrics.readings );
+	if (g->bench.seconds) {
+		if (!g->bench.readings++) g->bench.first_t = r.t;
+		g->bench.last_t = r.t;
+	}
+	if (m->cache_valid) {
+		struct stats_snap_s ss;
+
+		if (m->stats.enabled) stats_snap( &m->stats, &ss );
+		else memset(&ss, 0, sizeof(ss));
+		if (m->index == 0) capture_add( &g->capture, r.t, m->v, m->mode_index, m->range_value );
+		hist_push( g->hist, g->server_wake_fd, r.t, m->v, m->index, m->mode_index, m->range_value, &ss );
+	}
+	if (g->debug) fprintf(stderr,"%d: Value:%f Range: %s\n", m->index, m->v, m->range_label);
+}
+
+
+/*
+ * send_rate()
+ *
+ * Sets the meter's detection rate if one was given with -r; done at
+ * start up and again whenever we might have lost it (port re-acquired,
+ * front panel used while paused).
+ *
+ */
+void send_rate( glb *g, struct meter_s *m ) {
+	char cmd[50];
+
+	if (!g->detect_rate) return;
+	snprintf(cmd, sizeof(cmd), SCPI_RATE, g->detect_rate);
+	cmd_queue( g, m, CMD_PRI_USER, cmd, strlen(cmd), 0, 0 );
+}
+
+
+/*
+ * is_number()
+ *
+ * The whole reply is a number, nothing left over
+ *
+ */
+bool is_number( const char *s ) {
+	char *ep;
+
+	strtod(s, &ep);
+	return ep != s && *ep == '\0';
+}
+
+
+/*
+ * resync()
+ *
+ * A reply didn't turn up in time, or what did turn up made no
+ * sense; there may be stray or partial lines about. Rather than
+ * drop the port, throw away what's unread, ask *IDN? and discard
+ * everything until its answer (which can't be mistaken for
+ * anything else) comes back; the meter answers in order, so
+ * we're back in step from there. handle_line() then sends the
+ * last command again, up to CMD_RETRIES times, picking up in
+ * retry_state. Only when the sentinel itself goes unanswered
+ * RESYNC_ATTEMPTS times does handle_timer() reacquire.
+ *
+ */
+void resync( glb *g, struct meter_s *m, int retry_state ) {
+	metric_inc( &g->metrics.resyncs );
+	if (g->debug) fprintf(stderr,"%s:%d: Resynchronising %s, then state %d\n", FL, m->serial_params.device, retry_state);
+	cmd_clear( m, CMD_PRI_POLL );
+	tcflush(m->serial_params.fd, TCIFLUSH);
+	framer_reset( &m->framer );
+	m->retry_state = retry_state;
+	m->read_state = READSTATE_RESYNC;
+	cmd_queue( g, m, CMD_PRI_CONTROL, SCPI_IDN, strlen(SCPI_IDN), 1, REPLY_TIMEOUT );
+}
+
+
+/*
+ * process_state()
+ *
+ * Runs the SCPI query state machine one step, after a reply has
+ * been matched (handle_line), a reply deadline has passed or it's
+ * time for the next sample (handle_timer).  Nothing in here waits;
+ * whenever a query goes out the reply deadline is armed and we're
+ * back to epoll until the answer, or the deadline, arrives.
+ *
+ */
+void process_state( glb *g, struct meter_s *m ) {
+	int mi;
+
+	switch (m->read_state) {
+		case READSTATE_NONE:
+		case READSTATE_DONE:
+			m->sample_start = now_us();
+			if (cache_fresh( g, m )) {
+				if (g->bulk_count > 1) {
+					pipeline_send( g, m, true );
+				} else {
+					cmd_queue( g, m, CMD_PRI_POLL, SCPI_VAL1, strlen(SCPI_VAL1), 1, REPLY_TIMEOUT );
+					m->read_state = READSTATE_READING_FASTVAL;
+				}
+				break;
+			}
+			if (g->query_mode != QUERYMODE_SEQUENTIAL) {
+				pipeline_send( g, m, false );
+				break;
+			}
+			cmd_queue( g, m, CMD_PRI_POLL, SCPI_FUNC, strlen(SCPI_FUNC), 1, REPLY_TIMEOUT );
+			m->read_state = READSTATE_READING_FUNCTION;
+			break;
+
+		case READSTATE_FINISHED_FUNCTION:
+			// check the value of the buffer and determine
+			// which mode-index (mi) we need for later --- idiot!
+			//
+			mi = find_mode( g, m, m->line.p );
+
+			if (mi == MMODES_MAX) {
+				fprintf(stderr,"%s:%d: Unknown mode '%s'\n", FL, m->line.p);
+				resync( g, m, READSTATE_READING_FUNCTION );
+				break;
+			}
+
+			m->mode_index = mi;
+
+			cmd_queue( g, m, CMD_PRI_POLL, SCPI_VAL1, strlen(SCPI_VAL1), 1, REPLY_TIMEOUT );
+			m->read_state = READSTATE_READING_VAL;
+			break;
+
+		case READSTATE_FINISHED_VAL:
+			if (!is_number( m->line.p )) {
+				if (g->debug) fprintf(stderr,"%s:%d: VAL1 reply '%s' isn't a number\n", FL, m->line.p);
+				resync( g, m, READSTATE_READING_VAL );
+				break;
+			}
+			m->v = strtod(m->line.p, NULL);
+			m->reading_t = m->line.t;
+			snprintf(m->value, sizeof(m->value), "%f", m->v);
+
+			cmd_queue( g, m, CMD_PRI_POLL, SCPI_RANGE, strlen(SCPI_RANGE), 1, REPLY_TIMEOUT );
+			m->read_state = READSTATE_READING_RANGE;
+			break;
+
+		case READSTATE_FINISHED_RANGE:
+			if (!is_number( m->line.p )) {
+				if (g->debug) fprintf(stderr,"%s:%d: RANGE reply '%s' isn't a number\n", FL, m->line.p);
+				resync( g, m, READSTATE_READING_RANGE );
+				break;
+			}
+			snprintf(m->range, sizeof(m->range), "%s", m->line.p);
+			if (m->mode_index == MMODES_CONT) { 
+				cmd_queue( g, m, CMD_PRI_POLL, SCPI_CONT_THRESHOLD, strlen(SCPI_CONT_THRESHOLD), 1, REPLY_TIMEOUT );
+				m->read_state = READSTATE_READING_CONTLIMIT;
+			} else {
+				config_refreshed( m );
+				m->read_state = READSTATE_FINISHED_ALL;
+			}
+			break;
+
+		case READSTATE_FINISHED_CONTLIMIT:
+			m->cont_threshold = strtol(m->line.p, NULL, 10);
+			config_refreshed( m );
+			m->read_state = READSTATE_FINISHED_ALL;
+			break;
+
+		case READSTATE_FINISHED_FASTVAL:
+			{
+				/*
+				 * A reply that isn't a number means we've lost sync
+				 * with the meter or the function has been changed
+				 * from the front panel; drop the cache and do a full
+				 * FUNC/VAL1/RANGE cycle next time around.
+				 */
+				char *ep;
+				double v = strtod(m->line.p, &ep);
+
+				if (!m->cache_valid || ep == m->line.p || *ep != '\0') {
+					if (g->debug) fprintf(stderr,"%s:%d: VAL1 reply '%s' failed sanity check, refreshing\n", FL, m->line.p);
+					m->cache_valid = 0;
+					if (m->line.p == ep || *ep != '\0') resync( g, m, READSTATE_NONE );
+					else m->read_state = READSTATE_DONE;
+					break;
+				}
+				m->v = v;
+				m->reading_t = m->line.t;
+				m->read_state = READSTATE_FINISHED_ALL;
+			}
+			break;
+
+		case READSTATE_FINISHED_PIPELINE:
+			{
+				/*
+				 * Replies are in the same order as pipeline_send()
+				 * queued the queries; [FUNC,] VAL1 x bulk_count [, RANGE [, CONT:THR]]
+				 */
+				int k = 0;
+
+				if (!m->pipe_fast) {
+					bool garbled = false;
+
+					mi = find_mode( g, m, m->pipe_reply[k++] );
+					if (mi == MMODES_MAX) {
+						fprintf(stderr,"%s:%d: Unknown mode '%s'\n", FL, m->pipe_reply[0]);
+						resync( g, m, READSTATE_READING_PIPELINE );
+						break;
+					}
+
+					/*
+					 * Every VAL1 and the RANGE have to be numbers
+					 * before any of the batch is believed
+					 */
+					for (int i = k; i <= k +g->bulk_count && !garbled; i++) {
+						if (!is_number( m->pipe_reply[i] )) {
+							if (g->debug) fprintf(stderr,"%s:%d: Reply '%s' isn't a number\n", FL, m->pipe_reply[i]);
+							garbled = true;
+						}
+					}
+					if (garbled) {
+						resync( g, m, READSTATE_READING_PIPELINE );
+						break;
+					}
+					snprintf(m->range, sizeof(m->range), "%s", m->pipe_reply[k +g->bulk_count]);
+					if (m->pipe_expected > k +g->bulk_count +1 && mi == MMODES_CONT) m->cont_threshold = strtol(m->pipe_reply[k +g->bulk_count +1], NULL, 10);
+					m->mode_index = mi;
+					config_refreshed( m );
+				}
+
+				/*
+				 * Every VAL1? is published as its own reading with
+				 * the time its reply arrived, the last one goes
+				 * through the normal FINISHED_ALL path below.
+				 */
+				for (int i = 0; i < g->bulk_count; i++, k++) {
+					char *ep;
+					double v = strtod(m->pipe_reply[k], &ep);
+
+					if (m->pipe_fast && (!m->cache_valid || ep == m->pipe_reply[k] || *ep != '\0')) {
+						if (g->debug) fprintf(stderr,"%s:%d: VAL1 reply '%s' failed sanity check, refreshing\n", FL, m->pipe_reply[k]);
+						m->cache_valid = 0;
+						if (ep == m->pipe_reply[k] || *ep != '\0') resync( g, m, READSTATE_NONE );
+						else m->read_state = READSTATE_DONE;
+						break;
+					}
+					m->v = v;
+					m->reading_t = m->pipe_time[k];
+					if (i < g->bulk_count -1) publish_reading( g, m );
+					else m->read_state = READSTATE_FINISHED_ALL;
+				}
+			}
+			break;
+
+		case READSTATE_ERROR:
+		default:
+			snprintf(m->range,sizeof(m->range),"---");
+			snprintf(m->range_label,sizeof(m->range_label),"---");
+			snprintf(m->value,sizeof(m->value),"---");
+			m->cache_valid = 0;
+			snprintf(m->func,sizeof(m->func),"no data, check port");
+			m->reading_t = now_us();
+			fprintf(stderr,"default readstate reached, error!\n");
+			m->read_state = READSTATE_FINISHED_ALL;
+			break;
+	} // switch readstate
+
+	switch (m->read_state) {
+		case READSTATE_FINISHED_ALL:
+			m->read_state = READSTATE_DONE;
+			m->retries = 0;
+			publish_reading( g, m );
+
+			/*
+			 * -t paces the start of each sample, not each query
+			 */
+			if (m->error_flag) {
+				m->error_flag = false;
+				set_timer( m->timer_fd, ERROR_BACKOFF );
+			} else {
+				uint64_t elapsed = now_us() - m->sample_start;
+				set_timer( m->timer_fd, elapsed < (uint64_t)g->interval ? g->interval - elapsed : 0 );
+			}
+			break;
+
+		case READSTATE_DONE:
+			set_timer( m->timer_fd, 0 ); // abandoned part way, start again straight away
+			break;
+
+		default:
+			break; // waiting on the meter, cmd_queue() armed the deadline
+	}
+}
+
+
+/*
+ * handle_line()
+ *
+ * A complete reply line has come in from the framer; match it to
+ * whatever we're waiting on and move the state machine along.
+ *
+ */
+void handle_line( glb *g, struct meter_s *m, struct line_view_s *lv ) {
+
+	switch (m->read_state) {
+		case READSTATE_READING_FUNCTION:
+		case READSTATE_READING_VAL:
+		case READSTATE_READING_RANGE:
+		case READSTATE_READING_CONTLIMIT:
+		case READSTATE_READING_FASTVAL:
+			bench_add( g->bench.rtt, &g->bench.rtt_n, m->query_sent, lv->t );
+			metric_observe( &g->metrics.reply[metric_cmd( m->read_state )], m->query_sent, lv->t );
+			m->line = *lv;
+			m->read_state++;
+			break;
+
+		case READSTATE_RESYNC:
+			if (!strstr(lv->p, "GDM8341")) {
+				if (g->debug) fprintf(stderr,"%s:%d: Discarding '%s' while resynchronising\n", FL, lv->p);
+				return;
+			}
+			m->read_failure = 0;
+
+			/*
+			 * Back in step; have another go at whatever went
+			 * wrong, unless it's already had its chances
+			 */
+			if (m->retry_state != READSTATE_NONE && m->retries < CMD_RETRIES && m->last_cmd.len) {
+				m->retries++;
+				metric_inc( &g->metrics.retries );
+				m->read_state = m->retry_state;
+				m->pipe_received = 0;
+				cmd_queue( g, m, m->last_pri, m->last_cmd.text, m->last_cmd.len, m->last_cmd.replies, m->last_cmd.timeout );
+				return;
+			}
+			m->read_state = (m->retry_state == READSTATE_NONE) ? READSTATE_DONE : READSTATE_ERROR;
+			break;
+
+		case READSTATE_SWITCHING:
+			/*
+			 * Everything ahead of the switch's own *IDN? answer is
+			 * from before it, even a FUNC1 naming the same function.
+			 * A resync sentinel still in flight has nothing behind
+			 * it, so taking that for ours only lets our own *IDN?
+			 * through to be discarded below.
+			 */
+			if (!m->switch_synced) {
+				if (strstr(lv->p, "GDM8341")) m->switch_synced = true;
+				else if (g->debug) fprintf(stderr,"%s:%d: Discarding '%s' from before the switch\n", FL, lv->p);
+				return;
+			}
+			if (find_mode( g, m, lv->p ) != m->switch_mode) {
+				if (g->debug) fprintf(stderr,"%s:%d: Discarding '%s' from before the switch\n", FL, lv->p);
+				return;
+			}
+			metric_observe( &g->metrics.reply[METRIC_CMD_FUNC], m->query_sent, lv->t );
+			m->line = *lv;
+			m->read_state = READSTATE_FINISHED_FUNCTION;
+			break;
+
+		case READSTATE_READING_PIPELINE:
+			{
+				/*
+				 * Replies may come back one line per query or as a
+				 * single ';' separated line; either way they're
+				 * matched, in order, in to pipe_reply[]
+				 */
+				char *p, *save = NULL;
+
+				bench_add( g->bench.rtt, &g->bench.rtt_n, m->query_sent, lv->t );
+				for (p = strtok_r((char *)lv->p, ";", &save); p && m->pipe_received < PIPELINE_MAX; p = strtok_r(NULL, ";", &save)) {
+					snprintf(m->pipe_reply[m->pipe_received], PIPE_REPLY_SIZE, "%s", p);
+					m->pipe_time[m->pipe_received] = lv->t;
+					m->pipe_received++;
+				}
+				if (m->pipe_received < m->pipe_expected) return;
+				metric_observe( &g->metrics.reply[METRIC_CMD_BATCH], m->query_sent, lv->t );
+				m->read_state = READSTATE_FINISHED_PIPELINE;
+			}
+			break;
+
+		default:
+			/*
+			 * Nothing is waiting on a reply, such as the answer
+			 * to a hotkey MEAS:...? arriving between samples
+			 */
+			if (g->debug) fprintf(stderr,"%s:%d: Discarding unsolicited reply '%s'\n", FL, lv->p);
+			return;
+	}
+
+	process_state( g, m );
+}
+
+
+/*
+ * publish_status()
+ *
+ * Puts a message up in place of this meter's reading, ie while
+ * it's disconnected
+ *
+ */
+void publish_status( glb *g, struct meter_s *m, const char *line1, const char *line2 ) {
+	struct reading_s r;
+
+	memset(&r, 0, sizeof(r));
+	r.t = now_us();
+	r.meter = m->index;
+	r.mode_index = MMODES_MAX;
+	snprintf(r.line1, sizeof(r.line1), "%s", line1);
+	snprintf(r.line2, sizeof(r.line2), "%s", line2);
+	if (!ring_push( &g->display_ring, &r )) g->ring_drops++;
+	wake( g->ui_wake_fd );
+}
+
+
+/*
+ * port_lost()
+ *
+ * The port has gone, EOF/EIO or its device node was removed.
+ * Stop talking to it and wait for it to come back; handle_hotplug()
+ * will have another go the moment anything turns up in /dev, the
+ * timer is only a backstop.
+ *
+ */
+void port_lost( glb *g, struct meter_s *m, const char *why ) {
+	fprintf(stderr,"%s:%d: Lost %s (%s)\n", FL, m->serial_params.device, why);
+	metric_inc( &g->metrics.port_lost );
+	if (m->serial_params.fd >= 0) {
+		epoll_ctl(g->acq_epoll, EPOLL_CTL_DEL, m->serial_params.fd, NULL);
+		close( m->serial_params.fd );
+		m->serial_params.fd = -1;
+	}
+	framer_reset( &m->framer );
+	cmd_reset( m );
+	m->read_state = READSTATE_NONE;
+	m->read_failure = 0;
+	m->cache_valid = 0;
+	m->disconnected = true;
+	publish_status( g, m, "Disconnected", strlen(m->device) ? m->device : "Waiting for meter" );
+	set_timer( m->timer_fd, RECONNECT_BACKSTOP );
+}
+
+
+/*
+ * reacquire()
+ *
+ * Drops the current port, if there still is one, and goes looking
+ * for the meter again
+ *
+ */
+void reacquire( glb *g, struct meter_s *m ) {
+	uint64_t start = now_us();
+	int r;
+
+	m->probe_pending = false;
+	if (m->serial_params.fd >= 0) {
+		epoll_ctl(g->acq_epoll, EPOLL_CTL_DEL, m->serial_params.fd, NULL);
+		close( m->serial_params.fd );
+		m->serial_params.fd = -1;
+	}
+	framer_reset( &m->framer );
+	cmd_reset( m );
+
+	if (strlen(m->device)) {
+		/*
+		 * Not there yet, no point having open_port() say so
+		 * every time
+		 */
+		if (access(m->device, F_OK) != 0) {
+			r = PORT_NO_SUCCESS;
+		} else {
+			memcpy(m->serial_params.device, m->device, sizeof(m->serial_params.device));
+			m->serial_params.device[sizeof(m->serial_params.device) -1] = '\0';
+			r = open_port( g, m );
+		}
+	} else {
+		r = find_port( g, m );
+	}
+	metric_observe( &g->metrics.reacquire, start, now_us() );
+	metric_inc( &g->metrics.reacquires );
+
+	if (r != PORT_OK) {
+		metric_inc( &g->metrics.reacquire_failures );
+		m->serial_params.fd = -1;
+		if (!m->disconnected) {
+			fprintf(stderr,"Unable to find a port with the multimeter, waiting for it to turn up\n");
+			m->disconnected = true;
+			publish_status( g, m, "Disconnected", strlen(m->device) ? m->device : "Waiting for meter" );
+		}
+		set_timer( m->timer_fd, RECONNECT_BACKSTOP );
+	} else {
+		if (m->disconnected) fprintf(stderr,"Meter on %s again\n", m->serial_params.device);
+		m->disconnected = false;
+		m->read_failure = 0;
+		m->retries = 0;
+		serial_watch( g, m );
+		m->read_state = READSTATE_NONE;
+		m->cache_valid = 0;
+		send_rate( g, m );
+		set_timer( m->timer_fd, 0 );
+	}
+}
+
+
+/*
+ * hotplug_init()
+ *
+ * inotify on /dev, and on the directory of each -p port (ie
+ * /dev/serial/by-id or wherever the simulator put its link), so
+ * the meter coming and going is seen as it happens
+ *
+ */
+int hotplug_init( glb *g ) {
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	const uint32_t mask = IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM;
+
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: No inotify (%s), falling back to retrying every %dms\n", FL, strerror(errno), RECONNECT_BACKSTOP /1000);
+		return -1;
+	}
+	g->hotplug_dev_wd = inotify_add_watch(fd, "/dev", mask);
+	for (int k = 0; k < g->meter_count; k++) {
+		char dir[PATH_MAX];
+		char *slash;
+
+		snprintf(dir, sizeof(dir), "%s", g->meters[k].device);
+		slash = strrchr(dir, '/');
+		if (!slash || slash == dir) continue;
+		*slash = '\0';
+		if (strcmp(dir, "/dev") && inotify_add_watch(fd, dir, mask) < 0 && g->debug) {
+			fprintf(stderr,"%s:%d: Unable to watch %s (%s)\n", FL, dir, strerror(errno));
+		}
+	}
+	return fd;
+}
+
+
+/*
+ * hotplug_relevant()
+ *
+ * A tty in /dev, or one of the -p ports by name wherever it lives;
+ * everything else in those directories is none of our business
+ *
+ */
+static bool hotplug_relevant( glb *g, const struct inotify_event *ev ) {
+	if (ev->wd == g->hotplug_dev_wd && strncmp(ev->name, "tty", 3) == 0) return true;
+	for (int k = 0; k < g->meter_count; k++) {
+		const char *name = strrchr(g->meters[k].device, '/');
+
+		if (name && strcmp(name +1, ev->name) == 0) return true;
+	}
+	return false;
+}
+
+
+/*
+ * handle_hotplug()
+ *
+ * Something came or went. A port we have open going away means
+ * it's been unplugged; a port turning up while a meter's
+ * disconnected is worth another look straight away, and again as
+ * udev gets round to its permissions.
+ *
+ * A -p port is only an open() so that's done here and now. Going
+ * looking for the meter blocks this thread for up to
+ * PROBE_TIMEOUT_US, and plugging anything in makes a burst of
+ * events, so that waits on the meter's timer for PROBE_SETTLE and
+ * everything turning up meanwhile is covered by the one probe.
+ *
+ */
+void handle_hotplug( glb *g ) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool appeared = false;
+	ssize_t len;
+
+	while ((len = read(g->hotplug_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (char *p = buf; p < buf +len; p += sizeof(struct inotify_event) +ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (!ev->len || !hotplug_relevant( g, ev )) continue;
+			metric_inc( &g->metrics.hotplug_events );
+
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				for (int k = 0; k < g->meter_count; k++) {
+					struct meter_s *m = &g->meters[k];
+					const char *name = strrchr(m->serial_params.device, '/');
+
+					if (m->serial_params.fd < 0 || !name || strcmp(name +1, ev->name)) continue;
+					port_lost( g, m, "removed" );
+				}
+			} else {
+				appeared = true;
+			}
+		}
+	}
+
+	for (int k = 0; appeared && !g->acq_paused && k < g->meter_count; k++) {
+		struct meter_s *m = &g->meters[k];
+
+		if (!m->disconnected) continue;
+		if (strlen(m->device)) {
+			reacquire( g, m );
+		} else if (!m->probe_pending) {
+			m->probe_pending = true;
+			set_timer( m->timer_fd, PROBE_SETTLE );
+		}
+	}
+}
+
+
+/*
+ * handle_timer()
+ *
+ * Either it's time to start the next sample or the reply we were
+ * waiting for hasn't turned up in time
+ *
+ */
+void handle_timer( glb *g, struct meter_s *m ) {
+	if (g->acq_paused) return;
+
+	if (m->serial_params.fd < 0) {
+		reacquire( g, m );
+		return;
+	}
+
+	if (m->read_state == READSTATE_RESYNC) {
+		/*
+		 * Not even *IDN? is being answered; only now is it worth
+		 * dropping the port and going looking for the meter again
+		 */
+		if (++m->read_failure >= RESYNC_ATTEMPTS) {
+			fprintf(stderr,"%s:%d: No answer from %s, reacquiring\n", FL, m->serial_params.device);
+			metric_inc( &g->metrics.failure_resets );
+			reacquire( g, m );
+			return;
+		}
+		resync( g, m, m->retry_state );
+		return;
+	}
+
+	if (m->read_state != READSTATE_NONE && m->read_state != READSTATE_DONE) {
+		g->bench.timeouts++;
+		metric_inc( &g->metrics.reply_timeouts );
+		if (g->debug) fprintf(stderr,"%s:%d: Reply timeout in state %d\n", FL, m->read_state);
+		resync( g, m, m->read_state );
+		return;
+	}
+
+	process_state( g, m );
+}
+
+
+/*
+ * mode_switch()
+ *
+ * A hotkey wants the meter in another function. Whatever
+ * transaction is running is abandoned rather than having the
+ * switch land in the middle of it; queued polls and unread input
+ * are dropped, then CONF: (which doesn't answer) goes out with
+ * *IDN? and SENS:FUNC1? behind it. Replies still in flight from
+ * the old transaction are thrown away by handle_line() until the
+ * *IDN? answer marks where the switch starts, and FUNC1 then comes
+ * back as the new function, from which the usual VAL1?/RANGE?
+ * carries on straight away.
+ *
+ */
+void mode_switch( glb *g, struct meter_s *m, int mi, uint64_t t ) {
+	char cmd[100];
+
+	if (m->serial_params.fd < 0) return;
+	if (g->acq_paused) {
+		cmd_queue( g, m, CMD_PRI_USER, mmodes[mi].conf, strlen(mmodes[mi].conf), 0, 0 );
+		return;
+	}
+
+	cmd_clear( m, CMD_PRI_POLL );
+	tcflush(m->serial_params.fd, TCIFLUSH); // input only, a part-written command still has to go out whole
+	framer_reset( &m->framer );
+	m->cache_valid = 0;
+	m->switch_mode = mi;
+	m->switch_t = t;
+	m->switch_synced = false;
+	m->retries = 0;
+	m->sample_start = now_us();
+
+	snprintf(cmd, sizeof(cmd), "%s%s%s", mmodes[mi].conf, SCPI_IDN, SCPI_FUNC);
+	m->read_state = READSTATE_SWITCHING;
+	cmd_queue( g, m, CMD_PRI_USER, cmd, strlen(cmd), 2, SWITCH_TIMEOUT );
+
+	/*
+	 * Put the new function up now rather than leave the old
+	 * reading showing until the first new one arrives
+	 */
+	publish_status( g, m, "---", mmodes[mi].label );
+}
+
+
+/*
+ * handle_commands()
+ *
+ * The UI has poked our wake eventfd; pick up hotkey mode
+ * changes (for the selected meter) and pause/unpause (all of them)
+ *
+ */
+void handle_commands( glb *g ) {
+	int cmd = __atomic_exchange_n(&g->pending_mode, -1, __ATOMIC_ACQ_REL);
+	uint64_t cmd_t = __atomic_load_n(&g->pending_mode_t, __ATOMIC_ACQUIRE);
+	int paused = __atomic_load_n(&g->paused, __ATOMIC_ACQUIRE);
+	int sel = __atomic_load_n(&g->selected_meter, __ATOMIC_ACQUIRE);
+
+	if (cmd >= 0 && cmd < MMODES_MAX && sel >= 0 && sel < g->meter_count) mode_switch( g, &g->meters[sel], cmd, cmd_t );
+
+	if (paused && !g->acq_paused) {
+		g->acq_paused = 1;
+		for (int k = 0; k < g->meter_count; k++) {
+			struct meter_s *m = &g->meters[k];
+
+			if (m->serial_params.fd < 0) continue;
+			cmd_clear( m, CMD_PRI_POLL );
+			cmd_queue( g, m, CMD_PRI_CONTROL, SCPI_LOCAL, strlen(SCPI_LOCAL), 0, 0 );
+		}
+
+	} else if (!paused && g->acq_paused) {
+		/*
+		 * The front panel may well have been used while
+		 * we were paused, so start again from scratch
+		 */
+		g->acq_paused = 0;
+		for (int k = 0; k < g->meter_count; k++) {
+			struct meter_s *m = &g->meters[k];
+
+			if (m->serial_params.fd >= 0) tcflush(m->serial_params.fd, TCIFLUSH);
+			framer_reset( &m->framer );
+			m->read_state = READSTATE_NONE;
+			m->cache_valid = 0;
+			send_rate( g, m );
+			set_timer( m->timer_fd, 0 );
+		}
+	}
+}
+
+
+/*
+ * acquire_thread()
+ *
+ * Runs the SCPI query state machines on their own so that a slow
+ * render, or the UI waiting on events, never holds up the meters.
+ * Completed readings are handed to the UI via g->display_ring.
+ *
+ * Everything is driven from one epoll set; each meter's serial port
+ * (replies) and timerfd (reply deadlines and sample pacing), told
+ * apart by ACQ_SRC(), an eventfd the UI pokes when it has posted
+ * something for us through g->pending_mode / g->paused / g->quit,
+ * and the inotify that tells us ports have come or gone.
+ * The meters run independently, each as fast as it answers; their
+ * readings share the one CLOCK_MONOTONIC timebase.
+ *
+ */
+void *acquire_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+
+	watch_fd( g->acq_epoll, g->wake_fd, ACQ_SRC_WAKE );
+	if (g->hotplug_fd >= 0) watch_fd( g->acq_epoll, g->hotplug_fd, ACQ_SRC_HOTPLUG );
+	for (int k = 0; k < g->meter_count; k++) {
+		struct meter_s *m = &g->meters[k];
+
+		watch_fd( g->acq_epoll, m->timer_fd, ACQ_SRC(ACQ_SRC_TIMER, k) );
+		if (m->serial_params.fd >= 0) {
+			serial_watch( g, m );
+			send_rate( g, m );
+		} else {
+			m->disconnected = true;
+			publish_status( g, m, "Disconnected", strlen(m->device) ? m->device : "Waiting for meter" );
+		}
+		set_timer( m->timer_fd, 0 );
+	}
+
+	while (!__atomic_load_n(&g->quit, __ATOMIC_ACQUIRE)) {
+		struct epoll_event evs[2 *METERS_MAX +2];
+		int n = epoll_wait(g->acq_epoll, evs, 2 *METERS_MAX +2, -1);
+
+		for (int i = 0; i < n; i++) {
+			struct meter_s *m = &g->meters[ACQ_METER(evs[i].data.u32)];
+			uint64_t count;
+			ssize_t r;
+
+			switch (ACQ_SRC_TYPE(evs[i].data.u32)) {
+				case ACQ_SRC_SERIAL:
+					{
+						struct line_view_s lv;
+
+						if (m->serial_params.fd < 0) break;
+						if (evs[i].events & EPOLLOUT) cmd_flush( g, m );
+						if (!(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) break;
+						r = framer_fill( &m->framer, m->serial_params.fd );
+						if (r <= 0) {
+							if (r < 0 && (errno == EAGAIN || errno == EINTR)) break;
+							port_lost( g, m, r ? strerror(errno) : "EOF" );
+							break;
+						}
+						while (framer_next( &m->framer, &lv )) handle_line( g, m, &lv );
+					}
+					break;
+
+				case ACQ_SRC_TIMER:
+					/*
+					 * Nothing to read means the timer was re-armed
+					 * (ie by mode_switch()) after this event was
+					 * queued; it's not a timeout
+					 */
+					r = read(m->timer_fd, &count, sizeof(count));
+					if (r != sizeof(count)) break;
+					handle_timer( g, m );
+					break;
+
+				case ACQ_SRC_WAKE:
+					r = read(g->wake_fd, &count, sizeof(count));
+					handle_commands( g );
+					break;
+
+				case ACQ_SRC_HOTPLUG:
+					handle_hotplug( g );
+					break;
+			}
+		}
+	} // while !quit
+
+	for (int k = 0; k < g->meter_count; k++) {
+		struct meter_s *m = &g->meters[k];
+
+		if (m->serial_params.fd < 0) continue;
+		cmd_clear( m, CMD_PRI_POLL );
+		cmd_queue( g, m, CMD_PRI_CONTROL, SCPI_LOCAL, strlen(SCPI_LOCAL), 0, 0 );
+		cmd_drain( g, m, 200000 );
+	}
+
+	return NULL;
+}
+
+
+/*
+ * server_listen_unix() / server_listen_tcp()
+ *
+ * Non-blocking listening sockets for the reading server; TCP is
+ * bound to the loopback address only.
+ *
+ */
+int server_listen_unix( const char *path ) {
+	struct sockaddr_un sa;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+		fprintf(stderr,"Can't listen on '%s' (%s)\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int server_listen_tcp( int port ) {
+	struct sockaddr_in sa;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+		fprintf(stderr,"Can't listen on 127.0.0.1:%d (%s)\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void client_drop( glb *g, struct client_s *c, const char *why ) {
+	if (g->debug) fprintf(stderr,"%s:%d: Dropping client %d, %s\n", FL, c->fd, why);
+	epoll_ctl(g->server_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+}
+
+
+/*
+ * client_pump()
+ *
+ * Moves readings from the client's cursor in to its queue and
+ * the queue out to the socket until either it's caught up or the
+ * socket would block, in which case we wait for EPOLLOUT.
+ *
+ */
+void client_pump( glb *g, struct client_s *c, int slot ) {
+	struct hist_ring_s *h = g->hist;
+
+	while (c->fd >= 0) {
+		uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+		if (head -c->next > HIST_SIZE) {
+			client_drop( g, c, "too slow" );
+			return;
+		}
+
+		/*
+		 * Compact, then fill
+		 */
+		if (c->q_start == c->q_end) c->q_start = c->q_end = 0;
+		else if (c->q_start > CLIENT_QUEUE_SIZE /2) {
+			memmove(c->q, c->q +c->q_start, c->q_end -c->q_start);
+			c->q_end -= c->q_start;
+			c->q_start = 0;
+		}
+
+		while (c->next < head && CLIENT_QUEUE_SIZE -c->q_end >= CLIENT_LINE_MAX) {
+			struct hist_entry_s e = h->e[c->next & (HIST_SIZE -1)];
+			char *q = c->q +c->q_end;
+			uint64_t t;
+			int n;
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&h->head, __ATOMIC_RELAXED) -c->next >= HIST_SIZE) {
+				client_drop( g, c, "too slow" );
+				return;
+			}
+
+			t = e.t +g->rt_offset;
+			n = snprintf(q, CLIENT_LINE_MAX, g->meter_count > 1 ? "%lu.%06lu,%.8g,%s,%g,%d" : "%lu.%06lu,%.8g,%s,%g"
+					, (unsigned long)(t /1000000)
+					, (unsigned long)(t %1000000)
+					, e.v
+					, e.mode_index < MMODES_MAX ? mmodes[e.mode_index].scpi : "?"
+					, e.range
+					, e.meter +1
+					);
+			if (g->stats.enabled) n += stats_fields( q +n, CLIENT_LINE_MAX -n, &e.stats );
+			n += snprintf(q +n, CLIENT_LINE_MAX -n, "\n");
+			c->q_end += n;
+			c->next++;
+		}
+
+		if (c->q_start == c->q_end) break;
+
+		ssize_t w = send(c->fd, c->q +c->q_start, c->q_end -c->q_start, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (w < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			client_drop( g, c, strerror(errno) );
+			return;
+		}
+		c->q_start += w;
+	}
+
+	if (c->fd < 0) return;
+
+	/*
+	 * Only ask for EPOLLOUT while there's something stuck in the
+	 * queue, otherwise every idle client would wake us constantly
+	 */
+	int want_out = (c->q_start != c->q_end);
+	if (want_out != c->want_out) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+		ev.data.u32 = SRV_SRC_CLIENT +slot;
+		epoll_ctl(g->server_epoll, EPOLL_CTL_MOD, c->fd, &ev);
+		c->want_out = want_out;
+	}
+}
+
+
+/*
+ * client_accept()
+ *
+ * New subscribers start -H seconds back in the history, or at
+ * the oldest reading still held if that's more recent.
+ *
+ */
+void client_accept( glb *g, int lfd ) {
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct hist_ring_s *h = g->hist;
+		struct client_s *c = NULL;
+		uint64_t head, oldest, since;
+		int slot;
+
+		for (slot = 0; slot < CLIENTS_MAX; slot++) {
+			if (g->clients[slot].fd < 0) { c = &g->clients[slot]; break; }
+		}
+		if (!c) {
+			if (g->debug) fprintf(stderr,"%s:%d: Too many clients, refusing\n", FL);
+			close(fd);
+			continue;
+		}
+
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		oldest = head > HIST_SIZE -1 ? head -(HIST_SIZE -1) : 0;
+		since = now_us() -(uint64_t)g->replay_seconds *1000000;
+		c->next = head;
+		while (c->next > oldest && h->e[(c->next -1) & (HIST_SIZE -1)].t >= since) c->next--;
+
+		c->fd = fd;
+		c->q_start = 0;
+		c->q_end = snprintf(c->q, CLIENT_QUEUE_SIZE, "# gdm-8341 seconds,value,mode,range%s%s\n"
+				, g->meter_count > 1 ? ",meter" : ""
+				, g->stats.enabled ? STATS_COLUMNS : ""
+				);
+		c->want_out = 0;
+		watch_fd( g->server_epoll, fd, SRV_SRC_CLIENT +slot );
+		if (g->debug) fprintf(stderr,"%s:%d: Client %d connected, replaying %lu readings\n", FL, fd, (unsigned long)(head -c->next));
+		client_pump( g, c, slot );
+	}
+}
+
+
+/*
+ * server_thread()
+ *
+ * Third epoll loop; listening sockets, clients and an eventfd
+ * that hist_push() pokes for every new reading. Nothing here can
+ * hold up acquisition, the only thing shared is the history ring.
+ *
+ */
+void *server_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+
+	if (g->server_unix_fd >= 0) watch_fd( g->server_epoll, g->server_unix_fd, SRV_SRC_UNIX );
+	if (g->server_tcp_fd >= 0) watch_fd( g->server_epoll, g->server_tcp_fd, SRV_SRC_TCP );
+	watch_fd( g->server_epoll, g->server_wake_fd, SRV_SRC_WAKE );
+
+	while (!__atomic_load_n(&g->quit, __ATOMIC_ACQUIRE)) {
+		struct epoll_event evs[16];
+		int n = epoll_wait(g->server_epoll, evs, 16, -1);
+
+		for (int i = 0; i < n; i++) {
+			uint32_t src = evs[i].data.u32;
+			uint64_t count;
+			ssize_t r;
+
+			if (src == SRV_SRC_UNIX) client_accept( g, g->server_unix_fd );
+			else if (src == SRV_SRC_TCP) client_accept( g, g->server_tcp_fd );
+			else if (src == SRV_SRC_WAKE) {
+				r = read(g->server_wake_fd, &count, sizeof(count));
+				(void)r;
+				/*
+				 * Clients already waiting on EPOLLOUT get pumped
+				 * when their socket drains; all we do for them here
+				 * is notice if they've fallen too far behind
+				 */
+				uint64_t head = __atomic_load_n(&g->hist->head, __ATOMIC_ACQUIRE);
+				for (int k = 0; k < CLIENTS_MAX; k++) {
+					struct client_s *c = &g->clients[k];
+
+					if (c->fd < 0) continue;
+					if (!c->want_out) client_pump( g, c, k );
+					else if (head -c->next >= HIST_SIZE) client_drop( g, c, "too slow" );
+				}
+			} else if (src >= SRV_SRC_CLIENT && src < SRV_SRC_CLIENT +CLIENTS_MAX) {
+				struct client_s *c = &g->clients[src -SRV_SRC_CLIENT];
+				char discard[256];
+
+				if (c->fd < 0) continue;
+
+				/*
+				 * Clients don't send us anything we act on, we
+				 * only read to notice them hanging up
+				 */
+				if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					r = recv(c->fd, discard, sizeof(discard), MSG_DONTWAIT);
+					if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+						client_drop( g, c, "hung up" );
+						continue;
+					}
+				}
+				client_pump( g, c, src -SRV_SRC_CLIENT );
+			}
+		}
+	} // while !quit
+
+	for (int k = 0; k < CLIENTS_MAX; k++) {
+		if (g->clients[k].fd >= 0) close(g->clients[k].fd);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * sink_open()
+ *
+ * (Re)opens a sink's file, truncating it; CSV files get their
+ * header line.
+ *
+ */
+int sink_open( glb *g, struct sink_s *s ) {
+	if (strcmp(s->path, "-")==0) {
+		s->fd = STDOUT_FILENO;
+	} else {
+		s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (s->fd < 0) {
+			fprintf(stderr,"Can't open log file '%s' (%s)\n", s->path, strerror(errno));
+			return -1;
+		}
+	}
+
+	s->size = 0;
+	if (s->format == SINK_FORMAT_CSV) {
+		s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len, "seconds,value,mode,logmode,range%s%s\n"
+				, g->meter_count > 1 ? ",meter" : ""
+				, g->stats.enabled ? STATS_COLUMNS : ""
+				);
+	}
+
+	return 0;
+}
+
+
+/*
+ * sink_write()
+ *
+ * Writes out whatever is batched up, all of it; a short write
+ * to a regular file is retried rather than dropped.
+ *
+ */
+void sink_write( glb *g, struct sink_s *s ) {
+	size_t done = 0;
+
+	while (done < s->len && s->fd >= 0) {
+		ssize_t w = write(s->fd, s->buf +done, s->len -done);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"Write to log '%s' failed (%s), batch dropped\n", s->path, strerror(errno));
+			break;
+		}
+		done += w;
+	}
+	s->size += done;
+	s->len = 0;
+
+	if (g->sink_sync == SINK_SYNC_FLUSH && s->fd != STDOUT_FILENO) fdatasync(s->fd);
+}
+
+
+void sink_close( glb *g, struct sink_s *s ) {
+	if (s->fd < 0) return;
+	if (s->len) sink_write( g, s );
+	if (s->fd != STDOUT_FILENO) {
+		if (g->sink_sync != SINK_SYNC_NONE) fsync(s->fd);
+		close(s->fd);
+	}
+	s->fd = -1;
+}
+
+
+/*
+ * sink_rotate()
+ *
+ * path.N-1 -> path.N ... path -> path.1, then start afresh.
+ *
+ */
+void sink_rotate( glb *g, struct sink_s *s ) {
+	char from[PATH_MAX +16], to[PATH_MAX +16];
+
+	sink_close( g, s );
+	for (int k = g->sink_keep; k > 1; k--) {
+		snprintf(from, sizeof(from), "%s.%d", s->path, k -1);
+		snprintf(to, sizeof(to), "%s.%d", s->path, k);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", s->path);
+	if (g->sink_keep > 0) rename(s->path, to);
+	sink_open( g, s );
+}
+
+
+/*
+ * sink_drain()
+ *
+ * Formats every reading the sink hasn't seen yet in to its batch
+ * buffer, writing the buffer out when it fills and rotating the
+ * file when it passes -lr bytes.
+ *
+ */
+void sink_drain( glb *g, struct sink_s *s ) {
+	struct hist_ring_s *h = g->hist;
+	uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+	if (s->fd < 0) return;
+
+	/*
+	 * Fallen more than a ring behind; skip to the oldest reading
+	 * we can still trust and say so
+	 */
+	if (head -s->next > HIST_SIZE -1) {
+		uint64_t skip = head -(HIST_SIZE -1) -s->next;
+		s->lost += skip;
+		s->next += skip;
+		fprintf(stderr,"Log '%s' fell behind, %lu readings lost\n", s->path, (unsigned long)skip);
+	}
+
+	while (s->next < head) {
+		struct hist_entry_s e = h->e[s->next & (HIST_SIZE -1)];
+		const char *label = e.mode_index < MMODES_MAX ? mmodes[e.mode_index].label : "";
+		const char *logmode = e.mode_index < MMODES_MAX ? mmodes[e.mode_index].logmode : "";
+		uint64_t t;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->head, __ATOMIC_RELAXED) -s->next >= HIST_SIZE) {
+			s->lost++;
+			s->next++;
+			continue;
+		}
+
+		if (SINK_BUF_SIZE -s->len < 512) {
+			sink_write( g, s );
+			if (g->sink_rotate_bytes && s->size >= g->sink_rotate_bytes && s->fd != STDOUT_FILENO) sink_rotate( g, s );
+			if (s->fd < 0) return;
+		}
+
+		t = e.t +g->rt_offset;
+		if (s->format == SINK_FORMAT_JSONL) {
+			s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len
+					, g->meter_count > 1 ? "{\"t\":%lu.%06lu,\"v\":%.10g,\"mode\":\"%s\",\"logmode\":\"%s\",\"range\":%g,\"meter\":%d"
+						: "{\"t\":%lu.%06lu,\"v\":%.10g,\"mode\":\"%s\",\"logmode\":\"%s\",\"range\":%g"
+					, (unsigned long)(t /1000000), (unsigned long)(t %1000000)
+					, e.v, label, logmode, e.range, e.meter +1
+					);
+			if (g->stats.enabled) {
+				s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len
+						, ",\"stats\":{\"n\":%lu,\"mean\":%.10g,\"sd\":%.4g,\"min\":%.10g,\"max\":%.10g,\"pp\":%.4g}"
+						, (unsigned long)e.stats.n, e.stats.mean, e.stats.sd, e.stats.min, e.stats.max, e.stats.max -e.stats.min
+						);
+			}
+			s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len, "}\n");
+		} else {
+			s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len
+					, g->meter_count > 1 ? "%lu.%06lu,%.10g,%s,%s,%g,%d" : "%lu.%06lu,%.10g,%s,%s,%g"
+					, (unsigned long)(t /1000000), (unsigned long)(t %1000000)
+					, e.v, label, logmode, e.range, e.meter +1
+					);
+			if (g->stats.enabled) s->len += stats_fields( s->buf +s->len, SINK_BUF_SIZE -s->len, &e.stats );
+			s->len += snprintf(s->buf +s->len, SINK_BUF_SIZE -s->len, "\n");
+		}
+		s->next++;
+	}
+
+	if (s->len) sink_write( g, s );
+	if (g->sink_rotate_bytes && s->size >= g->sink_rotate_bytes && s->fd != STDOUT_FILENO) sink_rotate( g, s );
+}
+
+
+/*
+ * log_thread()
+ *
+ * Wakes every -lf ms and writes out what's arrived since; nothing
+ * here touches the serial side so a slow disk only ever delays
+ * the log, never the meter.
+ *
+ */
+void *log_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+	struct itimerspec its;
+	int tfd, epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = g->sink_flush_ms /1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (g->sink_flush_ms %1000) *1000000L;
+	timerfd_settime(tfd, 0, &its, NULL);
+	watch_fd( epfd, tfd, LOG_SRC_TIMER );
+	watch_fd( epfd, g->log_wake_fd, LOG_SRC_WAKE );
+
+	while (!__atomic_load_n(&g->quit, __ATOMIC_ACQUIRE)) {
+		struct epoll_event evs[2];
+		int n = epoll_wait(epfd, evs, 2, -1);
+
+		for (int i = 0; i < n; i++) {
+			uint64_t count;
+			ssize_t r = read(evs[i].data.u32 == LOG_SRC_TIMER ? tfd : g->log_wake_fd, &count, sizeof(count));
+			(void)r;
+		}
+		for (int k = 0; k < g->sink_count; k++) sink_drain( g, &g->sinks[k] );
+	}
+
+	/*
+	 * Acquisition has stopped by now, so this catches the last
+	 * of the readings
+	 */
+	for (int k = 0; k < g->sink_count; k++) {
+		sink_drain( g, &g->sinks[k] );
+		sink_close( g, &g->sinks[k] );
+		if (g->debug && g->sinks[k].lost) fprintf(stderr,"%s:%d: Log '%s' lost %lu readings\n", FL, g->sinks[k].path, (unsigned long)g->sinks[k].lost);
+	}
+
+	close(tfd);
+	close(epfd);
+
+	return NULL;
+}
+
+
+/*
+ * metrics_write()
+ *
+ * Everything in struct metrics_s, in the Prometheus text format
+ *
+ */
+void metric_counter( FILE *f, const char *name, const char *help, uint64_t *c ) {
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, (unsigned long)__atomic_load_n(c, __ATOMIC_RELAXED));
+}
+
+void metric_hist( FILE *f, const char *name, const char *label, struct metric_hist_s *h ) {
+	const char *sep = label[0] ? "," : "";
+	char braced[60] = "";
+	uint64_t total = 0;
+
+	if (label[0]) snprintf(braced, sizeof(braced), "{%s}", label);
+	for (int b = 0; b <= METRIC_BUCKETS; b++) {
+		total += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+		if (b < METRIC_BUCKETS) fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, sep, metric_bounds[b] /1e6, (unsigned long)total);
+		else fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, (unsigned long)total);
+	}
+	fprintf(f, "%s_sum%s %.6f\n", name, braced, __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) /1e6);
+	fprintf(f, "%s_count%s %lu\n", name, braced, (unsigned long)total);
+}
+
+void metrics_write( glb *g, FILE *f ) {
+	struct metrics_s *m = &g->metrics;
+
+	metric_counter( f, "gdm8341_readings_total", "Readings published.", &m->readings );
+	metric_counter( f, "gdm8341_reply_timeouts_total", "Queries the meter did not answer in time.", &m->reply_timeouts );
+	metric_counter( f, "gdm8341_failure_resets_total", "Ports dropped after in-band resynchronisation failed.", &m->failure_resets );
+	metric_counter( f, "gdm8341_resyncs_total", "Resynchronisations after a reply timeout or garbled reply.", &m->resyncs );
+	metric_counter( f, "gdm8341_retries_total", "Commands sent again after a resynchronisation.", &m->retries );
+	metric_counter( f, "gdm8341_port_lost_total", "EOF or error reading the port.", &m->port_lost );
+	metric_counter( f, "gdm8341_reacquires_total", "Attempts to reopen or find the meter's port.", &m->reacquires );
+	metric_counter( f, "gdm8341_reacquire_failures_total", "Attempts that did not find the meter.", &m->reacquire_failures );
+	metric_counter( f, "gdm8341_hotplug_events_total", "Device nodes appearing or disappearing.", &m->hotplug_events );
+	metric_counter( f, "gdm8341_commands_dropped_total", "Commands dropped because the outbound queue was full.", &m->cmd_dropped );
+
+	fprintf(f, "# HELP gdm8341_reply_seconds Time from a query being written to its reply arriving.\n# TYPE gdm8341_reply_seconds histogram\n");
+	for (int k = 0; k < METRIC_CMDS; k++) {
+		char label[50];
+
+		snprintf(label, sizeof(label), "command=\"%s\"", metric_cmd_names[k]);
+		metric_hist( f, "gdm8341_reply_seconds", label, &m->reply[k] );
+	}
+	fprintf(f, "# HELP gdm8341_reacquire_seconds Time taken by each attempt to reopen or find the port.\n# TYPE gdm8341_reacquire_seconds histogram\n");
+	metric_hist( f, "gdm8341_reacquire_seconds", "", &m->reacquire );
+	fprintf(f, "# HELP gdm8341_mode_switch_seconds Time from a function hotkey to the first reading in that function.\n# TYPE gdm8341_mode_switch_seconds histogram\n");
+	metric_hist( f, "gdm8341_mode_switch_seconds", "", &m->mode_switch );
+	fprintf(f, "# HELP gdm8341_render_seconds Time to draw a frame.\n# TYPE gdm8341_render_seconds histogram\n");
+	metric_hist( f, "gdm8341_render_seconds", "", &m->render );
+}
+
+
+/*
+ * metrics_textfile()
+ *
+ * Written to a temporary and renamed so a scrape never sees
+ * half a file
+ *
+ */
+void metrics_textfile( glb *g ) {
+	char tfn[PATH_MAX];
+	FILE *f;
+
+	if (!g->metrics_file) return;
+	snprintf(tfn, sizeof(tfn), "%s.tmp", g->metrics_file);
+	f = fopen(tfn, "w");
+	if (!f) {
+		if (g->debug) fprintf(stderr,"%s:%d: Unable to write %s (%s)\n", FL, tfn, strerror(errno));
+		return;
+	}
+	metrics_write( g, f );
+	fclose(f);
+	rename(tfn, g->metrics_file);
+}
+
+
+/*
+ * metrics_thread()
+ *
+ * Rewrites the -x textfile every -xi ms and dumps the metrics to
+ * stderr on SIGUSR1, which main() blocks in every thread so it
+ * only ever turns up here.
+ *
+ */
+void *metrics_thread( void *arg ) {
+	struct glb *g = (struct glb *)arg;
+	struct itimerspec its;
+	sigset_t ss;
+	int tfd, sfd, epfd;
+
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGUSR1);
+	sfd = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g->metrics_file) {
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = its.it_interval.tv_sec = g->metrics_interval /1000;
+		its.it_value.tv_nsec = its.it_interval.tv_nsec = (g->metrics_interval %1000) *1000000L;
+		timerfd_settime(tfd, 0, &its, NULL);
+	}
+	watch_fd( epfd, tfd, MET_SRC_TIMER );
+	watch_fd( epfd, sfd, MET_SRC_SIGNAL );
+	watch_fd( epfd, g->metrics_wake_fd, MET_SRC_WAKE );
+
+	while (!__atomic_load_n(&g->quit, __ATOMIC_ACQUIRE)) {
+		struct epoll_event evs[3];
+		int n = epoll_wait(epfd, evs, 3, -1);
+
+		for (int i = 0; i < n; i++) {
+			struct signalfd_siginfo si;
+			uint64_t count;
+			ssize_t r;
+
+			switch (evs[i].data.u32) {
+				case MET_SRC_TIMER:
+					r = read(tfd, &count, sizeof(count));
+					metrics_textfile( g );
+					break;
+
+				case MET_SRC_SIGNAL:
+					while (read(sfd, &si, sizeof(si)) == sizeof(si)) metrics_write( g, stderr );
+					break;
+
+				case MET_SRC_WAKE:
+					r = read(g->metrics_wake_fd, &count, sizeof(count));
+					break;
+			}
+			(void)r;
+		}
+	}
+
+	metrics_textfile( g );
+
+	close(tfd);
+	close(sfd);
+	close(epfd);
+
+	return NULL;
+}
+
+
+/*
+ * write_output()
+ *
+ * The -o hand-off file for FlexBV; only written when the reader
+ * has taken the previous one away, and only when there's a
+ * reading we haven't written yet.
+ *
+ */
+void write_output( glb *g, const char *tfn, const char *line1, int mode_index, bool *pending ) {
+	if (!g->output_file || mode_index >= MMODES_MAX || !*pending) return;
+	if (fileExists(g->output_file)) return;
+
+	FILE *f;
+
+	*pending = false;
+	f = fopen(tfn,"w");
+	if (f) {
+		fprintf(f,"%s\t%s", line1, mmodes[mode_index].logmode);
+		fclose(f);
+		chmod(tfn, S_IROTH|S_IWOTH|S_IRUSR|S_IWUSR);
+		rename(tfn, g->output_file);
+	}
+}
+
+
+/*
+ * headless_run()
+ *
+ * Stands in for the UI with -n, a HEADLESS build, or when there's
+ * no X display; keeps the -o file going and waits for SIGINT,
+ * SIGTERM or SIGHUP. main() has already blocked those so they
+ * only ever arrive here, through the signalfd.
+ *
+ * With -B it also plays the operator; every BENCH_SWITCH_US it
+ * posts a function change the same way the hotkeys do and times
+ * how long until a reading in the new function comes back, then
+ * stops once the benchmark has run its time.
+ *
+ */
+void headless_run( glb *g, const char *tfn ) {
+	struct reading_s r;
+	char line1[sizeof(r.line1)] = "";
+	int mode_index = MMODES_MAX;
+	bool output_pending = false;
+	bool stop = false;
+	sigset_t ss;
+	int sfd, epfd;
+	uint64_t start = now_us(), next_switch = start +BENCH_SWITCH_US, switch_t = 0;
+	int switch_mode = MMODES_MAX;
+
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	sigaddset(&ss, SIGTERM);
+	sigaddset(&ss, SIGHUP);
+	sfd = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	watch_fd( epfd, sfd, UI_SRC_SIGNAL );
+	watch_fd( epfd, g->ui_wake_fd, UI_SRC_WAKE );
+
+	while (!stop) {
+		struct epoll_event evs[2];
+		int timeout = -1;
+		int n;
+
+		if (g->bench.seconds) {
+			uint64_t now = now_us();
+
+			if (now -start >= (uint64_t)g->bench.seconds *1000000) break;
+			if (now >= next_switch) {
+				switch_mode = (mode_index == MMODES_VOLT_DC) ? MMODES_RES : MMODES_VOLT_DC;
+				switch_t = now;
+				next_switch = now +BENCH_SWITCH_US;
+				__atomic_store_n(&g->pending_mode_t, now, __ATOMIC_RELEASE);
+				__atomic_store_n(&g->pending_mode, switch_mode, __ATOMIC_RELEASE);
+				wake( g->wake_fd );
+			}
+			timeout = (next_switch -now) /1000 +1;
+		}
+
+		n = epoll_wait(epfd, evs, 2, timeout);
+
+		for (int i = 0; i < n; i++) {
+			if (evs[i].data.u32 == UI_SRC_SIGNAL) {
+				struct signalfd_siginfo si;
+
+				if (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+					if (g->debug) fprintf(stderr,"%s:%d: Signal %d, stopping\n", FL, si.ssi_signo);
+					stop = true;
+				}
+			} else {
+				uint64_t count;
+				ssize_t rr = read(g->ui_wake_fd, &count, sizeof(count));
+				(void)rr;
+			}
+		}
+
+		while (ring_pop( &g->display_ring, &r )) {
+			if (r.meter != 0) continue; // -o and -B follow the first meter
+			snprintf(line1, sizeof(line1), "%s", r.line1);
+			mode_index = r.mode_index;
+			output_pending = true;
+			if (switch_mode < MMODES_MAX && r.valid && r.mode_index == switch_mode) {
+				bench_add( g->bench.sw, &g->bench.sw_n, switch_t, now_us() );
+				switch_mode = MMODES_MAX;
+			}
+		}
+		write_output( g, tfn, line1, mode_index, &output_pending );
+	}
+
+	close(epfd);
+	close(sfd);
+}
+
+
+#ifndef HEADLESS
+/*
+ * grab_key()
+ *
+ * Function sets up a global XGrabKey() and additionally registers
+ * for num and cap lock keyboard combinations.
+ *
+ */
+void grab_key(Display* display, Window rootWindow, int keycode, int modifier) {
+	XGrabKey(display, keycode, modifier, rootWindow, false, GrabModeAsync, GrabModeAsync);
+
+	if (modifier != AnyModifier) {
+		XGrabKey(display, keycode, modifier | Mod2Mask, rootWindow, false, GrabModeAsync, GrabModeAsync);
+		XGrabKey(display, keycode, modifier | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
+		XGrabKey(display, keycode, modifier | Mod2Mask | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
+	}
+}
+
+
+/*
+ * Glyph atlas
+ *
+ * Every glyph we're likely to draw (printable ASCII covers the
+ * digits, signs, SI prefixes and the mmodes[] labels/units, plus
+ * the few non-ASCII symbols below) is rasterised once, in white, in
+ * to a single texture.  Text is then drawn as SDL_RenderCopy blits
+ * out of that texture, coloured with SDL_SetTextureColorMod, rather
+ * than rendering and uploading new surfaces every frame.
+ *
+ */
+#define ATLAS_FIRST 32
+#define ATLAS_LAST 126
+
+const Uint16 atlas_extra[] = { 0x00B5, 0x03A9, 0x00B0 }; // µ, Ω, °
+
+#define ATLAS_MAX ((ATLAS_LAST -ATLAS_FIRST +1) +(sizeof(atlas_extra)/sizeof(atlas_extra[0])))
+
+struct glyph_s {
+	Uint16 ch;
+	SDL_Rect src;
+	int advance;
+};
+
+struct atlas_s {
+	SDL_Texture *tex;
+	TTF_Font *font; // for the fallback path
+	struct glyph_s glyph[ATLAS_MAX];
+	int count;
+	int height;
+};
+
+
+/*
+ * atlas_build()
+ *
+ * On any failure the atlas is left empty and everything is
+ * drawn via the TTF fallback in draw_text()
+ *
+ */
+void atlas_build( struct atlas_s *a, SDL_Renderer *renderer, TTF_Font *font ) {
+	SDL_Surface *gs[ATLAS_MAX];
+	SDL_Surface *sheet;
+	SDL_Color white = { 255, 255, 255, 255 };
+	int width = 0;
+	int x = 0;
+
+	a->tex = NULL;
+	a->font = font;
+	a->count = 0;
+	a->height = TTF_FontHeight(font);
+
+	for (unsigned int i = 0; i < ATLAS_MAX; i++) {
+		Uint16 ch = (i <= ATLAS_LAST -ATLAS_FIRST) ? ATLAS_FIRST +i : atlas_extra[i -(ATLAS_LAST -ATLAS_FIRST +1)];
+		struct glyph_s *gl = &(a->glyph[a->count]);
+
+		if (!TTF_GlyphIsProvided(font, ch)) continue;
+
+		/*
+		 * Blank glyphs (space) can come back as no surface at
+		 * all, they still need an entry for their advance
+		 */
+		gs[a->count] = TTF_RenderGlyph_Blended(font, ch, white);
+		gl->ch = ch;
+		TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL, &(gl->advance));
+		gl->src = { width, 0, 0, 0 };
+		if (gs[a->count]) {
+			gl->src.w = gs[a->count]->w;
+			gl->src.h = gs[a->count]->h;
+			width += gs[a->count]->w;
+			if (gs[a->count]->h > a->height) a->height = gs[a->count]->h;
+		}
+		a->count++;
+	}
+
+	sheet = SDL_CreateRGBSurfaceWithFormat(0, width > 0 ? width : 1, a->height, 32, SDL_PIXELFORMAT_ARGB8888);
+	for (int i = 0; i < a->count; i++) {
+		if (!gs[i]) continue;
+		if (sheet) {
+			SDL_Rect dst = { x, 0, gs[i]->w, gs[i]->h };
+			SDL_SetSurfaceBlendMode(gs[i], SDL_BLENDMODE_NONE); // copy the coverage alpha as-is
+			SDL_BlitSurface(gs[i], NULL, sheet, &dst);
+			x += gs[i]->w;
+		}
+		SDL_FreeSurface(gs[i]);
+	}
+
+	if (sheet) {
+		a->tex = SDL_CreateTextureFromSurface(renderer, sheet);
+		SDL_FreeSurface(sheet);
+	}
+	if (a->tex) SDL_SetTextureBlendMode(a->tex, SDL_BLENDMODE_BLEND);
+	else a->count = 0;
+}
+
+
+void atlas_free( struct atlas_s *a ) {
+	if (a->tex) SDL_DestroyTexture(a->tex);
+	a->tex = NULL;
+	a->count = 0;
+}
+
+
+struct glyph_s *atlas_find( struct atlas_s *a, Uint16 ch ) {
+	if (ch >= ATLAS_FIRST && ch <= ATLAS_LAST) {
+		struct glyph_s *gl = &(a->glyph[ch -ATLAS_FIRST]);
+		if (ch -ATLAS_FIRST < a->count && gl->ch == ch) return gl;
+	}
+	for (int i = 0; i < a->count; i++) {
+		if (a->glyph[i].ch == ch) return &(a->glyph[i]);
+	}
+	return NULL;
+}
+
+
+/*
+ * utf8_next()
+ *
+ * Decodes one character from *s and advances past it, returns 0
+ * for anything outside the BMP or malformed (which forces the
+ * fallback path)
+ *
+ */
+Uint16 utf8_next( const char **s ) {
+	const unsigned char *p = (const unsigned char *)*s;
+	Uint16 ch = 0;
+
+	if (p[0] < 0x80) { ch = p[0]; *s += 1; }
+	else if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) { ch = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F); *s += 2; }
+	else if ((p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) { ch = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F); *s += 3; }
+	else *s += 1;
+
+	return ch;
+}
+
+
+/*
+ * draw_text()
+ *
+ * Draws s at x,y in colour c, blitting from the atlas when every
+ * character is in it, otherwise falling back to a one-off TTF
+ * render of the whole string.  w/h get the size of what was drawn.
+ *
+ */
+void draw_text( SDL_Renderer *renderer, struct atlas_s *a, const char *s, SDL_Color c, int x, int y, int *w, int *h ) {
+	const char *p = s;
+	int xs = x;
+
+	*w = 0;
+	*h = a->height;
+
+	while (*p) {
+		if (!atlas_find(a, utf8_next(&p))) break;
+	}
+
+	if (*p == '\0' && a->tex) {
+		SDL_SetTextureColorMod(a->tex, c.r, c.g, c.b);
+		p = s;
+		while (*p) {
+			struct glyph_s *gl = atlas_find(a, utf8_next(&p));
+			SDL_Rect dst = { x, y, gl->src.w, gl->src.h };
+			if (gl->src.w) SDL_RenderCopy(renderer, a->tex, &(gl->src), &dst);
+			x += gl->advance;
+		}
+		*w = x -xs;
+
+	} else {
+		SDL_Surface *surface = TTF_RenderUTF8_Blended(a->font, s, c);
+		SDL_Texture *texture;
+
+		if (!surface) return;
+		texture = SDL_CreateTextureFromSurface(renderer, surface);
+		SDL_QueryTexture(texture, NULL, NULL, w, h);
+		SDL_Rect dstrect = { x, y, *w, *h };
+		SDL_RenderCopy(renderer, texture, NULL, &dstrect);
+		SDL_DestroyTexture(texture);
+		SDL_FreeSurface(surface);
+	}
+}
+
+
+/*
+ * Trend graph
+ *
+ * The last -g readings, decimated as they arrive in to one min/max
+ * bucket per pixel column; each reading costs O(1) and drawing
+ * costs O(width) however many readings the graph covers.
+ *
+ */
+struct trend_s {
+	int columns; // graph width in pixels
+	int per_column; // readings per bucket
+	float *min, *max;
+	int *count;
+	unsigned int head; // bucket being filled
+	unsigned int used; // buckets with data, up to columns
+	int mode_index; // a mode change clears the graph
+	float range; // and so does a range change, it's plotted on one scale
+	SDL_Point *points;
+};
 
---------------------------------------------------------------------
-Changes:
 
-\------------------------------------------------------------------*/
-int main ( int argc, char **argv ) {
+int trend_init( struct trend_s *t, int columns, int readings ) {
+	memset(t, 0, sizeof(struct trend_s));
+	t->columns = columns > 1 ? columns : 2;
+	t->per_column = (readings +t->columns -1) /t->columns;
+	if (t->per_column < 1) t->per_column = 1;
+	t->mode_index = MMODES_MAX;
+	t->min = (float *)calloc(t->columns, sizeof(float));
+	t->max = (float *)calloc(t->columns, sizeof(float));
+	t->count = (int *)calloc(t->columns, sizeof(int));
+	t->points = (SDL_Point *)calloc(t->columns *2, sizeof(SDL_Point));
+	if (!t->min || !t->max || !t->count || !t->points) return -1;
 
-	SDL_Event event;
-	SDL_Surface *surface, *surface_2;
-	SDL_Texture *texture, *texture_2;
+	return 0;
+}
 
-	struct glb g;        // Global structure for passing variables around
-	char tfn[4096];
-	bool quit = false;
-	bool paused = false;
 
-	glbs = &g;
+void trend_free( struct trend_s *t ) {
+	free(t->min);
+	free(t->max);
+	free(t->count);
+	free(t->points);
+}
 
-	/*
-	 * Initialise the global structure
-	 */
-	init(&g);
 
-	/*
-	 * Parse our command line parameters
-	 */
-	parse_parameters(&g, argc, argv);
-	if (strlen(g.device) < 1 ) {
-		find_port( &g );
+void trend_add( struct trend_s *t, int mode_index, float range, double v ) {
+	if (!t->columns) return;
+
+	if (mode_index != t->mode_index || range != t->range) {
+		memset(t->count, 0, t->columns *sizeof(int));
+		t->head = t->used = 0;
+		t->mode_index = mode_index;
+		t->range = range;
 	}
 
-	if (g.debug) fprintf(stdout,"START\n");
+	if (t->used == 0) {
+		t->used = 1;
+	} else if (t->count[t->head] >= t->per_column) {
+		t->head = (t->head +1) %t->columns;
+		t->count[t->head] = 0;
+		if (t->used < (unsigned int)t->columns) t->used++;
+	}
 
-	g.comms_mode = CMODE_SERIAL;
-	snprintf(g.serial_params.device, PATH_MAX , "%s", g.device);
+	if (t->count[t->head] == 0 || v < t->min[t->head]) t->min[t->head] = v;
+	if (t->count[t->head] == 0 || v > t->max[t->head]) t->max[t->head] = v;
+	t->count[t->head]++;
+}
 
-	/* 
-	 * check paramters
-	 *
-	 */
-	if (g.font_size < 10) g.font_size = 10;
-	if (g.font_size > 200) g.font_size = 200;
 
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
+/*
+ * trend_draw()
+ *
+ * Plots the buckets in to x,y,w,h as one SDL_RenderDrawLines()
+ * call. The vertical scale comes from the range the meter is on,
+ * from -range for the DC modes that can go negative up to +range,
+ * or from the data itself when the mode has no numeric range.
+ *
+ */
+void trend_draw( SDL_Renderer *renderer, struct trend_s *t, float range, int x, int y, int w, int h, SDL_Color c ) {
+	float lo, hi;
+	int n = 0, prev_y = 0;
+
+	if (!t->used || h < 2) return;
+
+	if (range > 0) {
+		hi = range;
+		switch (t->mode_index) {
+			case MMODES_VOLT_DC:
+			case MMODES_CURR_DC:
+			case MMODES_VOLT_DCAC:
+			case MMODES_CURR_DCAC:
+				lo = -range;
+				break;
+			default:
+				lo = 0;
+				break;
+		}
+	} else {
+		lo = hi = t->min[t->head];
+		for (unsigned int i = 0; i < t->used; i++) {
+			unsigned int b = (t->head +t->columns -i) %t->columns;
+			if (t->min[b] < lo) lo = t->min[b];
+			if (t->max[b] > hi) hi = t->max[b];
+		}
+	}
+	if (hi <= lo) { hi += 0.5; lo -= 0.5; }
+
+	/*
+	 * Oldest bucket at the left; of each bucket's min and max draw
+	 * the one nearer the previous point first so the line doesn't
+	 * zig-zag across the band.
+	 */
+	for (unsigned int i = 0; i < t->used; i++) {
+		unsigned int b = (t->head +t->columns -(t->used -1) +i) %t->columns;
+		int px = x +(int)((long)(t->columns -t->used +i) *(w -1) /(t->columns -1));
+		int ymin = y +h -1 -(int)((t->min[b] -lo) /(hi -lo) *(h -1));
+		int ymax = y +h -1 -(int)((t->max[b] -lo) /(hi -lo) *(h -1));
+
+		if (ymin < y) ymin = y;
+		if (ymin > y +h -1) ymin = y +h -1;
+		if (ymax < y) ymax = y;
+		if (ymax > y +h -1) ymax = y +h -1;
+
+		if (n && abs(prev_y -ymax) < abs(prev_y -ymin)) {
+			t->points[n].x = px; t->points[n++].y = ymax;
+			if (ymin != ymax) { t->points[n].x = px; t->points[n++].y = ymin; }
+		} else {
+			t->points[n].x = px; t->points[n++].y = ymin;
+			if (ymin != ymax) { t->points[n].x = px; t->points[n++].y = ymax; }
+		}
+		prev_y = t->points[n -1].y;
+	}
 
+	if (n < 2) return;
+	SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, 255);
+	SDL_RenderDrawLines(renderer, t->points, n);
+}
 
-	//	find_port( &g );
-	//		  open_port( &g );
 
-	Display*    dpy     = XOpenDisplay(0);
+/*
+ * ui_run()
+ *
+ * The X/SDL front end; hotkeys, the window and its event loop.
+ * Returns when the window is closed or 'q' pressed, the caller
+ * then shuts acquisition down.
+ *
+ */
+void ui_run( glb *g, Display *dpy, const char *tfn ) {
+	SDL_Event event;
+	struct atlas_s atlas, atlas_small;
+	struct trend_s trend[METERS_MAX];
+	bool trend_dirty = false;
+	struct reading_s r;
+	bool quit = false;
+	bool paused = false;
+	bool visible = true;
+	bool redraw = true;
+	bool output_pending = false;
+	int mode_index = MMODES_MAX;
 	Window      root    = DefaultRootWindow(dpy);
 	XEvent      ev;
 	Window          grab_window     =  root;
 
 
+
 	// Shift key = ShiftMask / 0x01
 	// CapLocks = LockMask / 0x02
 	// Control = ControlMask / 0x04
@@ -783,8 +5079,8 @@ int main ( int argc, char **argv ) {
 
 	SDL_Init(SDL_INIT_VIDEO);
 	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
-	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size/2);
+	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g->font_size);
+	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g->font_size/2);
 
 	/*
 	 * Get the required window size.
@@ -792,13 +5088,17 @@ int main ( int argc, char **argv ) {
 	 * Parameters passed can override the font self-detect sizing
 	 *
 	 */
-	TTF_SizeText(font, " 00.0000V DCAC ", &g.window_width, &g.window_height);
-	g.window_height *= 1.85;
+	TTF_SizeText(font, " 00.0000V DCAC ", &g->window_width, &g->window_height);
+	g->window_height *= g->stats.enabled ? 2.4 : 1.85;
+	int text_height = g->window_height;
+	if (g->trend_readings > 0) g->window_height += g->font_size *1.5;
+	int row_height = g->window_height; // one row per meter
+	g->window_height *= g->meter_count;
 
-	if (g.wx_forced) g.window_width = g.wx_forced;
-	if (g.wy_forced) g.window_height = g.wy_forced;
+	if (g->wx_forced) g->window_width = g->wx_forced;
+	if (g->wy_forced) g->window_height = g->wy_forced;
 
-	SDL_Window *window = SDL_CreateWindow("gdm-8341", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
+	SDL_Window *window = SDL_CreateWindow("gdm-8341", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g->window_width, g->window_height, 0);
 	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
 	if (!font) {
 		fprintf(stderr,"Error trying to open font :( \r\n");
@@ -807,8 +5107,20 @@ int main ( int argc, char **argv ) {
 	SDL_RendererInfo info;
 	SDL_GetRendererInfo( renderer, &info );
 
+	atlas_build( &atlas, renderer, font );
+	atlas_build( &atlas_small, renderer, font_small );
+
+	for (int k = 0; g->trend_readings > 0 && k < g->meter_count; k++) {
+		if (trend_init( &trend[k], g->window_width, g->trend_readings ) != 0) {
+			fprintf(stderr,"Unable to allocate the trend graph\n");
+			exit(1);
+		}
+	}
+
+	if (SDL_GetWindowFlags(window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED)) visible = false;
+
 	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255 );
+	SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255 );
 
 	/* Clear the entire screen to our selected color. */
 	SDL_RenderClear(renderer);
@@ -819,48 +5131,115 @@ int main ( int argc, char **argv ) {
 	 * and hope that the almighty PID 1 will reap us
 	 *
 	 */
-	char line1[4096];
-	char line2[5000];
+	char line1[METERS_MAX][4096];
+	char line2[METERS_MAX][5000];
+	char line3[METERS_MAX][128];
+	char drawn1[METERS_MAX][sizeof(line1[0])];
+	char drawn2[METERS_MAX][sizeof(line2[0])];
+	char drawn3[METERS_MAX][sizeof(line3[0])];
+	int selected = 0;
+
+	for (int k = 0; k < g->meter_count; k++) {
+		snprintf(line1[k], sizeof(line1[k]), "---");
+		snprintf(line2[k], sizeof(line2[k]), "Waiting for meter");
+		line3[k][0] = drawn1[k][0] = drawn2[k][0] = drawn3[k][0] = '\0';
+	}
+
+	/*
+	 * The UI waits on one epoll set; the hotkey X connection, SDL's
+	 * X connection, the eventfd the acquisition thread pokes when it
+	 * has published a reading, and a timerfd for frame pacing.
+	 */
+	int ui_epoll = epoll_create1(EPOLL_CLOEXEC);
+	int frame_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	int sdl_tick_fd = -1;
+	uint64_t next_frame = 0;
+
+	watch_fd( ui_epoll, ConnectionNumber(dpy), UI_SRC_XKEYS );
+	watch_fd( ui_epoll, g->ui_wake_fd, UI_SRC_WAKE );
+	watch_fd( ui_epoll, frame_tfd, UI_SRC_FRAME );
+	{
+		SDL_SysWMinfo wm;
+		bool have_fd = false;
+
+		SDL_VERSION(&wm.version);
+#ifdef SDL_VIDEO_DRIVER_X11
+		if (SDL_GetWindowWMInfo(window, &wm) && wm.subsystem == SDL_SYSWM_X11) {
+			watch_fd( ui_epoll, ConnectionNumber(wm.info.x11.display), UI_SRC_SDL );
+			have_fd = true;
+		}
+#endif
+		if (!have_fd) {
+			/*
+			 * Not an X11 video driver, so nothing we can wait on
+			 * for SDL's events; poll them at the frame rate
+			 */
+			struct itimerspec its;
+
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_nsec = its.it_interval.tv_nsec = 1000000000 /g->frame_rate;
+			sdl_tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			timerfd_settime(sdl_tick_fd, 0, &its, NULL);
+			watch_fd( ui_epoll, sdl_tick_fd, UI_SRC_SDL_TICK );
+		}
+	}
+
 
 	while (!quit) {
 
-		if (!paused && !quit) {
-			if (XCheckMaskEvent(dpy, KeyPressMask, &ev)) {
+		/*
+		 * Drain every queued hotkey event, including the ones we
+		 * ignore while paused, otherwise the X connection stays
+		 * readable and epoll_wait() would never block
+		 */
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if (!paused) {
 				KeySym ks;
-				if (g.debug) fprintf(stderr,"Keypress event %X\n", ev.type);
+				int mi = -1;
+				if (g->debug) fprintf(stderr,"Keypress event %X\n", ev.type);
 				switch (ev.type) {
 					case KeyPress:
 						//					ks = XKeycodeToKeysym(dpy,ev.xkey.keycode,0);
 						ks = XkbKeycodeToKeysym(dpy, ev.xkey.keycode, 0, 0);
-						if (g.debug) fprintf(stderr,"Hot key pressed %X => %lx!\n", ev.xkey.keycode, ks);
+						if (g->debug) fprintf(stderr,"Hot key pressed %X => %lx!\n", ev.xkey.keycode, ks);
 						switch (ks) {
 							case XK_r:
-								data_write( &g, mmodes[MMODES_RES].query, strlen(mmodes[MMODES_RES].query) );
+								mi = MMODES_RES;
 								break;
 							case XK_v:
-								data_write( &g, mmodes[MMODES_VOLT_DC].query, strlen(mmodes[MMODES_VOLT_DC].query) );
+								mi = MMODES_VOLT_DC;
 								break;
 							case XK_c:
-								data_write( &g, mmodes[MMODES_CONT].query, strlen(mmodes[MMODES_CONT].query) );
+								mi = MMODES_CONT;
 								break;
 							case XK_d:
-								data_write( &g, mmodes[MMODES_DIOD].query, strlen(mmodes[MMODES_DIOD].query) );
+								mi = MMODES_DIOD;
 								break;
 							case XK_u:
-								data_write( &g, mmodes[MMODES_CAP].query, strlen(mmodes[MMODES_CAP].query) );
+								mi = MMODES_CAP;
 								break;
 							case XK_f:
-								data_write( &g, mmodes[MMODES_FREQ].query, strlen(mmodes[MMODES_FREQ].query) );
+								mi = MMODES_FREQ;
 								break;
 							default:
 								break;
 						} // keycode
+
+						/*
+						 * The acquisition thread does the actual sending
+						 */
+						if (mi >= 0) {
+							__atomic_store_n(&g->pending_mode_t, now_us(), __ATOMIC_RELEASE);
+							__atomic_store_n(&g->pending_mode, mi, __ATOMIC_RELEASE);
+							wake( g->wake_fd );
+						}
 						break;
 
 					default:
 						break;
 				}
-			} // check mask
+			} // !paused
 		}
 
 		while (SDL_PollEvent(&event)) {
@@ -868,12 +5247,31 @@ int main ( int argc, char **argv ) {
 			{
 				case SDL_KEYDOWN:
 					if (event.key.keysym.sym == SDLK_q) {
-						data_write( &g, SCPI_LOCAL, strlen(SCPI_LOCAL) );
 						quit = true;
 					}
 					if (event.key.keysym.sym == SDLK_p) {
 						paused ^= 1;
-						if (paused == true) data_write( &g, SCPI_LOCAL, strlen(SCPI_LOCAL) );
+						__atomic_store_n(&g->paused, paused, __ATOMIC_RELEASE);
+						wake( g->wake_fd );
+					}
+					if (event.key.keysym.sym >= SDLK_1 && event.key.keysym.sym < SDLK_1 +g->meter_count) {
+						selected = event.key.keysym.sym -SDLK_1;
+						__atomic_store_n(&g->selected_meter, selected, __ATOMIC_RELEASE);
+						redraw = true;
+					}
+					break;
+				case SDL_WINDOWEVENT:
+					switch (event.window.event) {
+						case SDL_WINDOWEVENT_HIDDEN:
+						case SDL_WINDOWEVENT_MINIMIZED:
+							visible = false;
+							break;
+						case SDL_WINDOWEVENT_SHOWN:
+						case SDL_WINDOWEVENT_EXPOSED:
+						case SDL_WINDOWEVENT_RESTORED:
+							visible = true;
+							redraw = true;
+							break;
 					}
 					break;
 				case SDL_QUIT:
@@ -883,319 +5281,354 @@ int main ( int argc, char **argv ) {
 		}
 
 
-		if (!paused && !quit) {
-
-			if (g.read_failure > 5) {
-				g.debug = 1;
-				fprintf(stderr,"Excess read failures; trying to reacquire the COM port again.\n");
-				if (g.serial_params.fd > 1) {
-					close( g.serial_params.fd );
-					g.serial_params.fd = -1;
-				}
-				if (find_port( &g ) != PORT_OK) {
-					fprintf(stderr,"Unable to find a port with the multimeter, sleeping for 2 seconds\n");
-					sleep(2);
-				}
-				g.debug = 0;
+		/*
+		 * Pick up whatever the acquisition thread has published
+		 * since the last frame, we only draw the latest.
+		 */
+		while (ring_pop( &g->display_ring, &r )) {
+			int k = r.meter;
+
+			if (k < 0 || k >= g->meter_count) continue;
+			snprintf(line1[k], sizeof(line1[k]), "%s", r.line1);
+			snprintf(line2[k], sizeof(line2[k]), "%s", r.line2);
+			snprintf(line3[k], sizeof(line3[k]), "%s", r.line3);
+			if (k == 0) {
+				mode_index = r.mode_index;
+				output_pending = true;
 			}
+			if (r.valid && g->trend_readings > 0) {
+				trend_add( &trend[k], r.mode_index, r.range, r.v );
+				trend_dirty = true;
+			}
+		}
 
-			if (g.read_state != READSTATE_NONE && g.read_state != READSTATE_DONE) {
-				data_read( &g );
+		if ( paused ) {
+			for (int k = 0; k < g->meter_count; k++) {
+				snprintf(line1[k], sizeof(line1[k]),"Paused");
+				snprintf(line2[k], sizeof(line2[k]),"Press p");
+				line3[k][0] = '\0';
 			}
+		}
 
-			switch (g.read_state) {
-				case READSTATE_NONE:
-				case READSTATE_DONE:
-					data_write( &g, SCPI_FUNC, strlen(SCPI_FUNC));
-					g.bp = g.read_buffer; *(g.bp) = '\0'; g.bytes_remaining = READ_BUF_SIZE;
-					g.read_state = READSTATE_READING_FUNCTION;
-					break;
 
-				case READSTATE_FINISHED_FUNCTION:
-					// check the value of the buffer and determine
-					// which mode-index (mi) we need for later --- idiot!
-					//
-					int mi;
-					for (mi = 0; mi < MMODES_MAX; mi++) {
-						if (strcmp(g.read_buffer, mmodes[mi].scpi)==0) {
-							if (g.debug) fprintf(stderr,"%s:%d: HIT on '%s' index %d\n", FL, g.read_buffer, mi);
-							break;
-						}
-					}
 
-					if (mi == MMODES_MAX) {
-						fprintf(stderr,"%s:%d: Unknown mode '%s'\n", FL, g.read_buffer);
-						continue;
-					}
+		/*
+		 * Only redraw when what's on screen would actually change,
+		 * not at all while the window can't be seen, and no more
+		 * often than -f; a change that comes in too soon is drawn
+		 * when the frame timer goes off.
+		 */
+		bool changed = redraw || trend_dirty;
+		for (int k = 0; k < g->meter_count && !changed; k++) {
+			changed = strcmp(line1[k], drawn1[k]) || strcmp(line2[k], drawn2[k]) || strcmp(line3[k], drawn3[k]);
+		}
 
-					g.mode_index = mi;
+		if (visible && changed && now_us() < next_frame) {
+			set_timer( frame_tfd, next_frame -now_us() );
 
-					data_write( &g, SCPI_VAL1, strlen(SCPI_VAL1) );
-					g.read_state = READSTATE_READING_VAL;
-					g.bp = g.read_buffer; *(g.bp) = '\0'; g.bytes_remaining = READ_BUF_SIZE;
-					break;
+		} else if (visible && changed) {
+			/*
+			 * Rendering
+			 *
+			 *
+			 */
+			int texW = 0;
+			int texH = 0;
+			int texW2 = 0;
+			int texH2 = 0;
+			int texW3 = 0;
+			int texH3 = 0;
+			uint64_t render_start = now_us();
+			SDL_RenderClear(renderer);
+			for (int k = 0; k < g->meter_count; k++) {
+				int y = k *row_height;
+				char l2[sizeof(line2[0]) +8];
+
+				/*
+				 * With more than one meter each row is numbered,
+				 * the one the hotkeys switch is marked with a *
+				 */
+				if (g->meter_count > 1) snprintf(l2, sizeof(l2), "%d%c %s", k +1, k == selected ? '*' : ':', line2[k]);
+				else snprintf(l2, sizeof(l2), "%s", line2[k]);
+
+				draw_text( renderer, &atlas, line1[k], g->font_color_pri, 0, y, &texW, &texH );
+				draw_text( renderer, &atlas_small, l2, g->font_color_sec, 0, y +texH -(texH /5), &texW2, &texH2 );
+				if (line3[k][0]) draw_text( renderer, &atlas_small, line3[k], g->font_color_sec, 0, y +texH -(texH /5) +texH2, &texW3, &texH3 );
+				if (g->trend_readings > 0) {
+					trend_draw( renderer, &trend[k], trend[k].range, 0, y +text_height, g->window_width, row_height -text_height -2, g->font_color_sec );
+					SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255 );
+				}
 
-				case READSTATE_FINISHED_VAL:
-					g.v = strtod(g.read_buffer, NULL);
-					snprintf(g.value, sizeof(g.value), "%f", g.v);
+				snprintf(drawn1[k], sizeof(drawn1[k]), "%s", line1[k]);
+				snprintf(drawn2[k], sizeof(drawn2[k]), "%s", line2[k]);
+				memcpy(drawn3[k], line3[k], sizeof(drawn3[k]));
+			}
+			trend_dirty = false;
+			SDL_RenderPresent(renderer);
+			metric_observe( &g->metrics.render, render_start, now_us() );
 
-					data_write( &g, SCPI_RANGE, strlen(SCPI_RANGE) );
-					g.read_state = READSTATE_READING_RANGE;
-					g.bp = g.read_buffer; *(g.bp) = '\0'; g.bytes_remaining = READ_BUF_SIZE;
-					break;
+			redraw = false;
+			next_frame = now_us() +1000000 /g->frame_rate;
+		}
 
-				case READSTATE_FINISHED_RANGE:
-					snprintf(g.range, sizeof(g.range), "%s", g.read_buffer);
-					if (g.mode_index == MMODES_CONT) { 
-						g.bp = g.read_buffer; *(g.bp) = '\0'; g.bytes_remaining = READ_BUF_SIZE;
-						data_write( &g, SCPI_CONT_THRESHOLD, strlen(SCPI_CONT_THRESHOLD) );
-						g.read_state = READSTATE_READING_CONTLIMIT;
-					} else {
-						g.read_state = READSTATE_FINISHED_ALL;
-					}
-					break;
 
-				case READSTATE_FINISHED_CONTLIMIT:
-					g.cont_threshold = strtol(g.read_buffer, NULL, 10);
-					g.read_state = READSTATE_FINISHED_ALL;
-					break;
+		write_output( g, tfn, line1[0], mode_index, &output_pending );
 
-				case READSTATE_ERROR:
-				default:
-					snprintf(g.range,sizeof(g.range),"---");
-					snprintf(g.value,sizeof(g.value),"---");
-					snprintf(g.func,sizeof(g.func),"no data, check port");
-					fprintf(stderr,"default readstate reached, error!\n");
-					g.read_state = READSTATE_FINISHED_ALL;
-					break;
-			} // switch readstate
+		/*
+		 * Rendering can pull events in to SDL's and Xlib's queues
+		 * without leaving anything readable on the sockets, so only
+		 * sleep once both queues are really empty
+		 */
+		SDL_PumpEvents();
+		if (quit || SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT) || XPending(dpy)) continue;
+
+		{
+			struct epoll_event evs[8];
+			int n = epoll_wait(ui_epoll, evs, 8, -1);
+
+			for (int i = 0; i < n; i++) {
+				uint64_t count;
+				ssize_t rr;
+
+				switch (evs[i].data.u32) {
+					case UI_SRC_WAKE: rr = read(g->ui_wake_fd, &count, sizeof(count)); break;
+					case UI_SRC_FRAME: rr = read(frame_tfd, &count, sizeof(count)); break;
+					case UI_SRC_SDL_TICK: rr = read(sdl_tick_fd, &count, sizeof(count)); break;
+					default: rr = 0; break; // X connections; Xlib/SDL do the reading
+				}
+				(void)rr;
+			}
+		}
 
-			if (g.read_state == READSTATE_FINISHED_ALL) {
-				g.read_state = READSTATE_DONE;
+	} // while(1)
 
+	for (int k = 0; g->trend_readings > 0 && k < g->meter_count; k++) trend_free( &trend[k] );
 
-				switch (g.mode_index) {
-					case MMODES_VOLT_DC:
-						if (strcmp(g.range,"0.5")==0) { 
-							snprintf(g.value,sizeof(g.value),"% 07.2f mV DC", g.v *1000.0);
-							snprintf(g.range,sizeof(g.range),"500mV");
-						}
-						else if (strcmp(g.range, "5")==0) { 
-							snprintf(g.value, sizeof(g.value), "% 07.4f V DC", g.v);
-							snprintf(g.range,sizeof(g.range),"5V");
-						}
-						else if (strcmp(g.range, "50")==0) { 
-							snprintf(g.value, sizeof(g.value), "% 07.3f V DC", g.v);
-							snprintf(g.range,sizeof(g.range),"50V");
-						}
-						else if (strcmp(g.range, "500")==0) { 
-							snprintf(g.value, sizeof(g.value), "% 07.2f V DC", g.v);
-							snprintf(g.range,sizeof(g.range),"500V");
-						}
-						else if (strcmp(g.range, "1000")==0) { 
-							snprintf(g.value, sizeof(g.value), "% 07.1f V DC", g.v);
-							snprintf(g.range,sizeof(g.range),"1000V");
-						}
-						break;
+	close(ui_epoll);
+	close(frame_tfd);
+	if (sdl_tick_fd >= 0) close(sdl_tick_fd);
 
-					case MMODES_VOLT_AC:
-						if (strcmp(g.range,"0.5")==0) { 
-							snprintf(g.value,sizeof(g.value),"% 07.2f mV AC", g.v *1000.0);
-							snprintf(g.range,sizeof(g.range),"500mV");
-						}
-						else if (strcmp(g.range, "5")==0) { snprintf(g.value, sizeof(g.value), "% 07.4f V AC", g.v);
-							snprintf(g.range,sizeof(g.range),"5V");
-						}
-						else if (strcmp(g.range, "50")==0) { snprintf(g.value, sizeof(g.value), "% 07.3f V AC", g.v);
-							snprintf(g.range,sizeof(g.range),"50V");
-						}
-						else if (strcmp(g.range, "500")==0) { snprintf(g.value, sizeof(g.value), "% 07.2f V AC", g.v);
-							snprintf(g.range,sizeof(g.range),"500V");
-						}
-						else if (strcmp(g.range, "750")==0) { snprintf(g.value, sizeof(g.value), "% 07.1f V AC", g.v);
-							snprintf(g.range,sizeof(g.range),"750V");
-						}
-						break;
+	XCloseDisplay(dpy);
 
-					case MMODES_VOLT_DCAC:
-						if (strcmp(g.range,"0.5")==0) snprintf(g.value,sizeof(g.value),"% 07.2f mV DCAC", g.v *1000.0);
-						else if (strcmp(g.range, "5")==0) snprintf(g.value, sizeof(g.value), "% 07.4f V DCAC", g.v);
-						else if (strcmp(g.range, "50")==0) snprintf(g.value, sizeof(g.value), "% 07.3f V DCAC", g.v);
-						else if (strcmp(g.range, "500")==0) snprintf(g.value, sizeof(g.value), "% 07.2f V DCAC", g.v);
-						else if (strcmp(g.range, "750")==0) snprintf(g.value, sizeof(g.value), "% 07.1f V DCAC", g.v);
-						break;
+	atlas_free( &atlas );
+	atlas_free( &atlas_small );
+	TTF_CloseFont(font);
+	TTF_CloseFont(font_small);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	TTF_Quit();
+	SDL_Quit();
+}
+#endif // !HEADLESS
 
-					case MMODES_CURR_AC:
-						if (strcmp(g.range,"0.0005")==0) snprintf(g.value,sizeof(g.value),"%06.2f %sA AC", g.v, uu);
-						else if (strcmp(g.range, "0.005")==0) snprintf(g.value, sizeof(g.value), "%06.4f mA AC", g.v);
-						else if (strcmp(g.range, "0.05")==0) snprintf(g.value, sizeof(g.value), "%06.3f mA AC", g.v);
-						else if (strcmp(g.range, "0.5")==0) snprintf(g.value, sizeof(g.value), "%06.2f mA AC", g.v);
-						else if (strcmp(g.range, "5")==0) snprintf(g.value, sizeof(g.value), "%06.1f A AC", g.v);
-						else if (strcmp(g.range, "10")==0) snprintf(g.value, sizeof(g.value), "%06.3f A AC", g.v);
-						break;
 
-					case MMODES_CURR_DC:
-						if (strcmp(g.range,"0.0005")==0) snprintf(g.value,sizeof(g.value),"%06.2f %sA DC", g.v, uu);
-						else if (strcmp(g.range, "0.005")==0) snprintf(g.value, sizeof(g.value), "%06.4f mA DC", g.v);
-						else if (strcmp(g.range, "0.05")==0) snprintf(g.value, sizeof(g.value), "%06.3f mA DC", g.v);
-						else if (strcmp(g.range, "0.5")==0) snprintf(g.value, sizeof(g.value), "%06.2f mA DC", g.v);
-						else if (strcmp(g.range, "5")==0) snprintf(g.value, sizeof(g.value), "%06.1f A DC", g.v);
-						else if (strcmp(g.range, "10")==0) snprintf(g.value, sizeof(g.value), "%06.3f A DC", g.v);
-						break;
+/*-----------------------------------------------------------------\
+  Date Code:	: 20180127-220307
+  Function Name	: main
+  Returns Type	: int
+  ----Parameter List
+  1. int argc,
+  2.  char **argv ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
 
-					case MMODES_RES:
-						if (strcmp(g.range,"50E+1")==0) { snprintf(g.value,sizeof(g.value),"%06.2f %s", g.v, oo);
-							snprintf(g.range,sizeof(g.range),"500%s",oo); }
-						else if (strcmp(g.range, "50E+2")==0){ snprintf(g.value, sizeof(g.value), "%06.4f k%s", g.v /1000, oo);
-							snprintf(g.range,sizeof(g.range),"5K%s",oo); }
-						else if (strcmp(g.range, "50E+3")==0){ snprintf(g.value, sizeof(g.value), "%06.3f k%s", g.v /1000, oo);
-							snprintf(g.range,sizeof(g.range),"50K%s",oo); }
-						else if (strcmp(g.range, "50E+4")==0){ snprintf(g.value, sizeof(g.value), "%06.2f k%s", g.v /1000, oo);
-							snprintf(g.range,sizeof(g.range),"500K%s",oo); }
-						else if (strcmp(g.range, "50E+5")==0){ snprintf(g.value, sizeof(g.value), "%06.4f M%s", g.v /1000000, oo);
-							snprintf(g.range,sizeof(g.range),"5M%s",oo); }
-						else if (strcmp(g.range, "50E+6")==0){ snprintf(g.value, sizeof(g.value), "%06.3f M%s", g.v /1000000, oo);
-							snprintf(g.range,sizeof(g.range),"50M%s",oo); }
-						if (g.v >= 51000000000000) snprintf(g.value, sizeof(g.value), "OL");
-						break;
+--------------------------------------------------------------------
+Changes:
 
-					case MMODES_CAP:
-						if (strcmp(g.range,"5E-9")==0) { snprintf(g.value,sizeof(g.value),"% 6.3f nF", g.v *1E+9 );
-							snprintf(g.range,sizeof(g.range),"5nF"); }
-						else if (strcmp(g.range, "5E-8")==0){ snprintf(g.value, sizeof(g.value), "% 06.2f nF", g.v *1E+9);
-							snprintf(g.range,sizeof(g.range),"50nF"); }
-						else if (strcmp(g.range, "5E-7")==0){ snprintf(g.value, sizeof(g.value), "% 06.1f nF", g.v *1E+9);
-							snprintf(g.range,sizeof(g.range),"500nF"); }
-						else if (strcmp(g.range, "5E-6")==0){ snprintf(g.value, sizeof(g.value), "% 06.3f %sF", g.v *1E+6, uu);
-							snprintf(g.range,sizeof(g.range),"5%sF",uu); }
-						else if (strcmp(g.range, "5E-5")==0){ snprintf(g.value, sizeof(g.value), "% 06.2f %sF", g.v *1E+6, uu);
-							snprintf(g.range,sizeof(g.range),"50%sF",uu); }
-						if (g.v >= 51000000000000) snprintf(g.value, sizeof(g.value), "OL");
-						break;
+\------------------------------------------------------------------*/
+int main ( int argc, char **argv ) {
 
+	struct glb g;        // Global structure for passing variables around
+	pthread_t acquire_tid, server_tid, log_tid, metrics_tid;
+	char tfn[4096];
 
-					case MMODES_CONT:
-						{ 
-							if (g.v > g.cont_threshold) {
-								if (g.v > 1000) g.v = 999.9;
-								snprintf(g.value, sizeof(g.value), "OPEN [%05.1f%s]", g.v, oo);
-							}
-							else {
-								snprintf(g.value, sizeof(g.value), "SHRT [%05.1f%s]", g.v, oo);
-							}
-							snprintf(g.range,sizeof(g.range),"Threshold: %d%s", g.cont_threshold, oo);
-						}
-						break;
+	glbs = &g;
 
-					case MMODES_DIOD:
-						{ 
-							if (g.v > 9.999) {
-								snprintf(g.value, sizeof(g.value), "OL / OPEN");
-							} else {
-								snprintf(g.value, sizeof(g.value), "%06.4f V", g.v);
-							}
-							snprintf(g.range,sizeof(g.range),"None");
-						}
-						break;
+	/*
+	 * Initialise the global structure
+	 */
+	init(&g);
+
+	/*
+	 * Parse our command line parameters
+	 */
+	parse_parameters(&g, argc, argv);
+	if (g.replay_file) {
+		return capture_replay( g.replay_file, g.replay_from, g.replay_to );
+	}
 
+	if (g.debug) fprintf(stdout,"START\n");
 
-				}
-				snprintf(line1, sizeof(line1), "%s", g.value);
-				snprintf(line2, sizeof(line2), "%s, %s", mmodes[g.mode_index].label, g.range);
-				if (g.debug) fprintf(stderr,"Value:%f Range: %s\n", g.v, g.range);
+	/*
+	 * With -p we use that port and nothing else (it may well not
+	 * be a ttyUSB, ie the simulator's pty); without it go hunting.
+	 * Either way a failure here isn't fatal, the acquisition
+	 * thread keeps trying.
+	 */
+	g.comms_mode = CMODE_SERIAL;
+	if (g.meter_count == 0) g.meter_count = 1;
+	for (int k = 0; k < g.meter_count; k++) {
+		struct meter_s *m = &g.meters[k];
 
+		if (strlen(m->device) < 1 ) {
+			find_port( &g, m );
+		} else {
+			memcpy(m->serial_params.device, m->device, sizeof(m->serial_params.device));
+			m->serial_params.device[sizeof(m->serial_params.device) -1] = '\0';
+			if (open_port( &g, m ) != PORT_OK) {
+				fprintf(stderr,"Unable to open %s, will keep trying\n", m->device);
 			}
-		} else if ( paused ) {
-			snprintf(line1, sizeof(line1),"Paused");
-			snprintf(line2, sizeof(line2),"Press p");
 		}
-		/*
-		 *
-		 * END OF DATA ACQUISITION
-		 *
-		 */
+	}
 
+	/* 
+	 * check paramters
+	 *
+	 */
+	if (g.font_size < 10) g.font_size = 10;
+	if (g.font_size > 200) g.font_size = 200;
+	if (g.frame_rate < 1) g.frame_rate = 1;
 
+	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
 
-		{
-			/*
-			 * Rendering
-			 *
-			 *
-			 */
-			int texW = 0;
-			int texH = 0;
-			int texW2 = 0;
-			int texH2 = 0;
-			SDL_RenderClear(renderer);
-			surface = TTF_RenderUTF8_Blended(font, line1, g.font_color_pri);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = { 0, 0, texW, texH };
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-
-			surface_2 = TTF_RenderUTF8_Blended(font_small, line2, g.font_color_sec);
-			texture_2 = SDL_CreateTextureFromSurface(renderer, surface_2);
-			SDL_QueryTexture(texture_2, NULL, NULL, &texW2, &texH2);
-			dstrect = { 0, texH -(texH /5), texW2, texH2 };
-			SDL_RenderCopy(renderer, texture_2, NULL, &dstrect);
+	g.acq_epoll = epoll_create1(EPOLL_CLOEXEC);
+	for (int k = 0; k < g.meter_count; k++) g.meters[k].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	g.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g.ui_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g.hotplug_fd = hotplug_init( &g );
+
+	if (g.capture_file && capture_open( &g.capture, g.capture_file ) != 0) exit(1);
+	if (g.shm_name && (g.shm = shm_open_reading( g.shm_name )) == NULL) exit(1);
+	for (int k = 0; k < g.meter_count; k++) {
+		g.meters[k].stats = g.stats;
+		if (stats_init( &g.meters[k].stats ) != 0) exit(1);
+	}
+	if (g.bench.seconds && bench_init( &g.bench ) != 0) exit(1);
+	g.metrics_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-			SDL_RenderPresent(renderer);
+	if (g.server_unix_path || g.server_tcp_port || g.sink_count) {
+		struct timespec rt, mt;
 
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-			if (1) {
-				SDL_DestroyTexture(texture_2);
-				SDL_FreeSurface(surface_2);
-			}
+		clock_gettime(CLOCK_REALTIME, &rt);
+		clock_gettime(CLOCK_MONOTONIC, &mt);
+		g.rt_offset = ((uint64_t)rt.tv_sec *1000000 +rt.tv_nsec /1000) -((uint64_t)mt.tv_sec *1000000 +mt.tv_nsec /1000);
 
-			if (g.error_flag) {
-				g.error_flag = false;
-				sleep(1);
+		g.hist = (struct hist_ring_s *)calloc(1, sizeof(struct hist_ring_s));
+		if (!g.hist) {
+			fprintf(stderr,"Unable to allocate the reading history\n");
+			exit(1);
+		}
+	}
 
-			} else {
-				usleep(g.interval);
-			}
+	if (g.server_unix_path || g.server_tcp_port) {
+		if (g.server_unix_path && (g.server_unix_fd = server_listen_unix( g.server_unix_path )) < 0) exit(1);
+		if (g.server_tcp_port && (g.server_tcp_fd = server_listen_tcp( g.server_tcp_port )) < 0) exit(1);
+		g.clients = (struct client_s *)calloc(CLIENTS_MAX, sizeof(struct client_s));
+		if (!g.clients) {
+			fprintf(stderr,"Unable to allocate the reading server clients\n");
+			exit(1);
 		}
+		for (int k = 0; k < CLIENTS_MAX; k++) g.clients[k].fd = -1;
+		g.server_epoll = epoll_create1(EPOLL_CLOEXEC);
+		g.server_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
 
+	for (int k = 0; k < g.sink_count; k++) {
+		g.sinks[k].buf = (char *)malloc(SINK_BUF_SIZE);
+		if (!g.sinks[k].buf || sink_open( &g, &g.sinks[k] ) != 0) exit(1);
+	}
+	if (g.sink_count) g.log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-		if (g.output_file) {
-			/*
-			 * Only write the file out if it doesn't
-			 * exist. 
-			 *
-			 */
-			if (!fileExists(g.output_file)) {
-				FILE *f;
-				f = fopen(tfn,"w");
-				if (f) {
-					fprintf(f,"%s\t%s", line1, mmodes[g.mode_index].logmode);
-					fclose(f);
-					chmod(tfn, S_IROTH|S_IWOTH|S_IRUSR|S_IWUSR);
-					rename(tfn, g.output_file);
-				}
-			}
+#ifndef HEADLESS
+	/*
+	 * Without an X display there's nothing to draw on; carry on
+	 * as if -n had been given rather than crashing in Xlib
+	 */
+	Display *dpy = NULL;
+	if (!g.headless) {
+		dpy = XOpenDisplay(0);
+		if (!dpy) {
+			fprintf(stderr,"Unable to open the X display, running headless\n");
+			g.headless = 1;
 		}
+	}
+#endif
 
-	} // while(1)
+	if (g.headless) {
+		sigset_t ss;
 
-	if (g.comms_mode == CMODE_USB) {
-		close(g.usb_fhandle);
+		/*
+		 * Before any threads start, so every thread inherits the
+		 * mask and the signals only reach headless_run()
+		 */
+		sigemptyset(&ss);
+		sigaddset(&ss, SIGINT);
+		sigaddset(&ss, SIGTERM);
+		sigaddset(&ss, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &ss, NULL);
+	}
+
+	{
+		sigset_t ss;
+
+		sigemptyset(&ss);
+		sigaddset(&ss, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &ss, NULL);
 	}
 
+	pthread_create( &acquire_tid, NULL, acquire_thread, &g );
+	pthread_create( &metrics_tid, NULL, metrics_thread, &g );
+	if (g.clients) pthread_create( &server_tid, NULL, server_thread, &g );
+	if (g.sink_count) pthread_create( &log_tid, NULL, log_thread, &g );
 
+#ifndef HEADLESS
+	if (!g.headless) ui_run( &g, dpy, tfn );
+#endif
+	if (g.headless) headless_run( &g, tfn );
+
+	__atomic_store_n(&g.quit, 1, __ATOMIC_RELEASE);
+	wake( g.wake_fd );
+	pthread_join( acquire_tid, NULL );
+	if (g.bench.seconds) bench_report( &g, stdout );
+	wake( g.metrics_wake_fd );
+	pthread_join( metrics_tid, NULL );
+	if (g.clients) {
+		wake( g.server_wake_fd );
+		pthread_join( server_tid, NULL );
+		if (g.server_unix_fd >= 0) {
+			close(g.server_unix_fd);
+			unlink(g.server_unix_path);
+		}
+		if (g.server_tcp_fd >= 0) close(g.server_tcp_fd);
+		free(g.clients);
+	}
+	if (g.sink_count) {
+		wake( g.log_wake_fd );
+		pthread_join( log_tid, NULL );
+		for (int k = 0; k < g.sink_count; k++) free(g.sinks[k].buf);
+	}
+	free(g.hist);
+	capture_close( &g.capture );
+	shm_close_reading( g.shm, g.shm_name );
 
-	close(g.serial_params.fd);
-	flock(g.serial_params.fd, LOCK_UN);
+	if (g.comms_mode == CMODE_USB) {
+		close(g.usb_fhandle);
+	}
 
+	for (int k = 0; k < g.meter_count; k++) {
+		struct meter_s *m = &g.meters[k];
 
-	XCloseDisplay(dpy);
+		stats_free( &m->stats );
+		if (g.debug) framer_stats( &m->framer, stderr );
+		flock(m->serial_params.fd, LOCK_UN);
+		close(m->serial_params.fd);
+		close(m->timer_fd);
+	}
+	if (g.hotplug_fd >= 0) close(g.hotplug_fd);
 
-	TTF_CloseFont(font);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	TTF_Quit();
-	SDL_Quit();
 
 	return 0;
 
@@ -0,0 +1,635 @@
+/*
+ * GwInstek GDM-8341 simulator
+ *
+ * Opens a pseudo-terminal and answers the SCPI subset that
+ * gdm-8341-sdl uses, so the display, its outputs and any speed
+ * changes can be exercised without a meter on the bench.
+ *
+ *	./gdm-8341-sim -L /tmp/ttyGDM &
+ *	./gdm-8341-sdl -p /tmp/ttyGDM
+ *
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define FL __FILE__,__LINE__
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define CMD_BUF_SIZE 4096
+#define REPLY_SIZE 1024
+#define OUT_CHUNKS 256 // pending output chunks
+#define OUT_CHUNK_SIZE 512
+
+#define SRC_PTY 1
+#define SRC_TIMER 2
+#define SRC_SIGNAL 3
+
+/*
+ * What the simulated meter can be set to; func is what
+ * SENS:FUNC1? answers with and what gdm-8341-sdl's mmodes[]
+ * matches against, meas is the MEAS:/CONF: suffix that selects
+ * it.
+ */
+struct sim_func_s {
+	char meas[20];
+	char func[12];
+	char range[12];
+	double nominal;
+	double noise; // fraction of nominal
+};
+
+struct sim_func_s funcs[] = {
+	{ "VOLT:DC", "VOLT", "5", 1.5, 0.001 },
+	{ "VOLT", "VOLT", "5", 1.5, 0.001 },
+	{ "VOLT:AC", "VOLT:AC", "5", 1.2, 0.002 },
+	{ "VOLT:DCAC", "VOLT:DCAC", "5", 1.9, 0.002 },
+	{ "CURR:DC", "CURR", "0.5", 0.12, 0.002 },
+	{ "CURR", "CURR", "0.5", 0.12, 0.002 },
+	{ "CURR:AC", "CURR:AC", "0.5", 0.08, 0.003 },
+	{ "CURR:DCAC", "CURR:DCAC", "0.5", 0.14, 0.003 },
+	{ "RES", "RES", "50E+3", 4700.0, 0.0005 },
+	{ "FREQ", "FREQ", "1", 1000.0, 0.0001 },
+	{ "PER", "PER", "1", 0.001, 0.0001 },
+	{ "TEMP:TCO", "TEMP", "1", 24.5, 0.01 },
+	{ "TEMP", "TEMP", "1", 24.5, 0.01 },
+	{ "DIOD", "DIOD", "5", 0.62, 0.001 },
+	{ "CONT", "CONT", "500", 0.4, 0.05 },
+	{ "CAP", "CAP", "5E-7", 1.0E-7, 0.002 },
+};
+
+#define FUNCS_MAX (int)(sizeof(funcs)/sizeof(funcs[0]))
+
+struct chunk_s {
+	uint64_t due; // CLOCK_MONOTONIC us
+	size_t len, sent;
+	char d[OUT_CHUNK_SIZE];
+};
+
+struct glb {
+	uint8_t debug;
+	char *link_path;
+	unsigned int seed;
+
+	int master_fd, slave_fd;
+	char slave_name[256];
+
+	uint64_t latency; // us per command
+	uint64_t jitter; // us, uniform 0..jitter added to latency
+	int baud; // 0 for unpaced output
+	int fragment_pct;
+	int garbage_pct;
+
+	int func; // funcs[] index
+	int cont_threshold;
+	char rate; // S, M, F
+	double value;
+	uint64_t next_sample;
+	int remote;
+
+	char cmd[CMD_BUF_SIZE];
+	size_t cmd_len;
+
+	struct chunk_s out[OUT_CHUNKS];
+	unsigned int out_head, out_tail;
+	uint64_t line_free; // when the simulated serial line is next idle
+
+	unsigned long commands, replies, bytes_out, fragments, garbage;
+};
+
+
+uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec *1000000 +ts.tv_nsec /1000;
+}
+
+
+int init( struct glb *g ) {
+	memset(g, 0, sizeof(struct glb));
+	g->master_fd = g->slave_fd = -1;
+	g->seed = time(NULL);
+	g->latency = 5000;
+	g->jitter = 0;
+	g->baud = 115200;
+	g->func = 0;
+	g->cont_threshold = 20;
+	g->rate = 'M';
+
+	return 0;
+}
+
+
+void show_help(void) {
+	fprintf(stdout,"GDM-8341 Multimeter simulator\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-d: debug enabled, show every command\r\n"
+			"\t-L <path> symlink the pty to <path>, ie /tmp/ttyGDM\r\n"
+			"\t-l <us> latency from command to reply (default 5000)\r\n"
+			"\t-j <us> add up to this much random jitter to each reply (default 0)\r\n"
+			"\t-s <baud> pace replies as a serial line at this speed, 0 for unpaced (default 115200)\r\n"
+			"\t-F <percent> chance of a reply arriving in several fragments\r\n"
+			"\t-G <percent> chance of garbage being sent before a reply\r\n"
+			"\t-f <function> starting function, ie VOLT:DC, RES, CAP (default VOLT:DC)\r\n"
+			"\t-S <seed> random seed, for repeatable runs\r\n"
+			"\r\n"
+			"\texample: gdm-8341-sim -L /tmp/ttyGDM -l 2000 -F 10\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+
+int find_func( const char *meas ) {
+	for (int i = 0; i < FUNCS_MAX; i++) {
+		if (strcasecmp(meas, funcs[i].meas)==0) return i;
+	}
+	return -1;
+}
+
+
+int parse_parameters( struct glb *g, int argc, char **argv ) {
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+
+		switch (argv[i][1]) {
+			case 'h':
+				show_help();
+				exit(1);
+				break;
+
+			case 'd': g->debug = 1; break;
+
+			case 'L':
+			case 'l':
+			case 'j':
+			case 's':
+			case 'F':
+			case 'G':
+			case 'f':
+			case 'S':
+				if (i +1 >= argc) {
+					fprintf(stdout,"Insufficient parameters; -%c needs a value, see -h\n", argv[i][1]);
+					exit(1);
+				}
+				i++;
+				switch (argv[i -1][1]) {
+					case 'L': g->link_path = argv[i]; break;
+					case 'l': g->latency = strtoull(argv[i], NULL, 10); break;
+					case 'j': g->jitter = strtoull(argv[i], NULL, 10); break;
+					case 's': g->baud = atoi(argv[i]); break;
+					case 'F': g->fragment_pct = atoi(argv[i]); break;
+					case 'G': g->garbage_pct = atoi(argv[i]); break;
+					case 'S': g->seed = strtoul(argv[i], NULL, 10); break;
+					case 'f':
+						g->func = find_func( argv[i] );
+						if (g->func < 0) {
+							fprintf(stdout,"Unknown function '%s'\n", argv[i]);
+							exit(1);
+						}
+						break;
+				}
+				break;
+
+			default: break;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * open_pty()
+ *
+ * The slave side is opened and held by us as well; that keeps
+ * the master readable across the client closing and reopening
+ * the port, and lets us put the line in raw mode so the client
+ * sees exactly the bytes we send.
+ *
+ */
+int open_pty( struct glb *g ) {
+	struct termios tp;
+	char *name;
+
+	g->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (g->master_fd < 0 || grantpt(g->master_fd) != 0 || unlockpt(g->master_fd) != 0) {
+		fprintf(stderr,"%s:%d: Unable to create a pty (%s)\n", FL, strerror(errno));
+		return -1;
+	}
+
+	name = ptsname(g->master_fd);
+	if (!name) return -1;
+	snprintf(g->slave_name, sizeof(g->slave_name), "%s", name);
+
+	g->slave_fd = open(g->slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (g->slave_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open %s (%s)\n", FL, g->slave_name, strerror(errno));
+		return -1;
+	}
+	tcgetattr(g->slave_fd, &tp);
+	cfmakeraw(&tp);
+	tcsetattr(g->slave_fd, TCSANOW, &tp);
+
+	fcntl(g->master_fd, F_SETFL, fcntl(g->master_fd, F_GETFL) | O_NONBLOCK);
+
+	if (g->link_path) {
+		unlink(g->link_path);
+		if (symlink(g->slave_name, g->link_path) != 0) {
+			fprintf(stderr,"%s:%d: Unable to link %s to %s (%s)\n", FL, g->link_path, g->slave_name, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * sample()
+ *
+ * The meter takes new readings at its detection rate, VAL1?
+ * returns the latest one; asking faster than that gets the same
+ * value again, as it does on the real thing.
+ *
+ */
+double sample( struct glb *g ) {
+	uint64_t now = now_us();
+
+	if (now >= g->next_sample) {
+		struct sim_func_s *f = &funcs[g->func];
+		double u = (rand() /(double)RAND_MAX) *2.0 -1.0;
+
+		g->value = f->nominal *(1.0 +u *f->noise);
+		switch (g->rate) {
+			case 'S': g->next_sample = now +200000; break;
+			case 'F': g->next_sample = now +25000; break;
+			default: g->next_sample = now +50000; break;
+		}
+	}
+
+	return g->value;
+}
+
+
+/*
+ * queue_out()
+ *
+ * Schedules bytes to reach the client at the given time. With
+ * baud pacing the line can only carry one character every 10
+ * bit times, so a chunk can't finish before the previous one has
+ * and its arrival is pushed back by its own length.
+ *
+ */
+void queue_out( struct glb *g, const char *d, size_t len, uint64_t ready ) {
+	while (len) {
+		struct chunk_s *c;
+		size_t n = len > OUT_CHUNK_SIZE ? OUT_CHUNK_SIZE : len;
+		uint64_t start = ready > g->line_free ? ready : g->line_free;
+
+		if (g->out_head -g->out_tail >= OUT_CHUNKS) {
+			if (g->debug) fprintf(stderr,"%s:%d: Output queue full, client isn't reading; dropping %zu bytes\n", FL, len);
+			return;
+		}
+
+		c = &g->out[g->out_head % OUT_CHUNKS];
+		memcpy(c->d, d, n);
+		c->len = n;
+		c->sent = 0;
+		c->due = start +(g->baud > 0 ? (uint64_t)n *10 *1000000 /g->baud : 0);
+		g->line_free = c->due;
+		g->out_head++;
+
+		d += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * queue_reply()
+ *
+ * Adds the line terminator, then optionally some garbage ahead of
+ * it and/or splits it in to fragments, before queueing it.
+ *
+ */
+void queue_reply( struct glb *g, const char *reply ) {
+	char buf[REPLY_SIZE +2];
+	uint64_t ready = now_us() +g->latency;
+	size_t len;
+
+	if (g->jitter) ready += rand() %(g->jitter +1);
+
+	if (g->garbage_pct && rand() %100 < g->garbage_pct) {
+		static const char junk[] = "#\x15?@\xff~%!";
+		char gb[16];
+		int n = 1 +rand() %8;
+
+		for (int i = 0; i < n; i++) gb[i] = junk[rand() %(sizeof(junk) -1)];
+
+		/*
+		 * Half the time it's a line on its own, the rest of the
+		 * time it's stuck to the front of the reply
+		 */
+		if (rand() %2) {
+			gb[n++] = '\r';
+			gb[n++] = '\n';
+		}
+		queue_out( g, gb, n, ready );
+		g->garbage++;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s\r\n", reply);
+	if (len >= sizeof(buf)) len = sizeof(buf) -1;
+
+	if (g->fragment_pct && len > 2 && rand() %100 < g->fragment_pct) {
+		size_t done = 0;
+		int pieces = 2 +rand() %3;
+
+		for (int i = 0; i < pieces && done < len; i++) {
+			size_t n = (i == pieces -1) ? len -done : 1 +rand() %(len -done);
+
+			/*
+			 * Unpaced, fragments would all go out at once; space
+			 * them so the client really has to read more than once
+			 */
+			queue_out( g, buf +done, n, ready +(g->baud > 0 ? 0 : (uint64_t)i *500) );
+			done += n;
+		}
+		g->fragments++;
+	} else {
+		queue_out( g, buf, len, ready );
+	}
+
+	g->replies++;
+}
+
+
+/*
+ * answer()
+ *
+ * One SCPI command, no leading ':' and upper-cased. Returns the
+ * reply, or NULL if the command doesn't produce one.
+ *
+ */
+const char *answer( struct glb *g, char *c, char *r, size_t rlen ) {
+	if (strcmp(c, "*IDN?")==0) {
+		snprintf(r, rlen, "GW.Inc,GDM8341,SIM0001,1.00");
+
+	} else if (strcmp(c, "SENS:FUNC1?")==0 || strcmp(c, "FUNC1?")==0) {
+		snprintf(r, rlen, "%s", funcs[g->func].func);
+
+	} else if (strcmp(c, "VAL1?")==0) {
+		snprintf(r, rlen, "%+.4E", sample( g ));
+
+	} else if (strcmp(c, "VAL2?")==0) {
+		snprintf(r, rlen, "%+.4E", 0.0);
+
+	} else if (strcmp(c, "CONF:RANG?")==0) {
+		snprintf(r, rlen, "%s", funcs[g->func].range);
+
+	} else if (strcmp(c, "SENS:CONT:THR?")==0) {
+		snprintf(r, rlen, "%d", g->cont_threshold);
+
+	} else if (strncmp(c, "SENS:CONT:THR ", 14)==0) {
+		g->cont_threshold = atoi(c +14);
+		return NULL;
+
+	} else if (strncmp(c, "SENS:DET:RATE ", 14)==0) {
+		if (strchr("SMF", c[14])) g->rate = c[14];
+		g->next_sample = 0;
+		return NULL;
+
+	} else if (strcmp(c, "SYST:LOC")==0) {
+		g->remote = 0;
+		return NULL;
+
+	} else if (strncmp(c, "MEAS:", 5)==0 || strncmp(c, "CONF:", 5)==0) {
+		size_t n = strlen(c);
+		int query = (c[n -1] == '?');
+		int f;
+
+		if (query) c[n -1] = '\0';
+		f = find_func( c +5 );
+		if (f < 0) {
+			if (g->debug) fprintf(stderr,"%s:%d: Unknown function in '%s'\n", FL, c);
+			return NULL;
+		}
+		g->func = f;
+		g->next_sample = 0;
+		if (!query) return NULL;
+		snprintf(r, rlen, "%+.4E", sample( g ));
+
+	} else {
+		if (g->debug) fprintf(stderr,"%s:%d: Unknown command '%s'\n", FL, c);
+		return NULL;
+	}
+
+	g->remote = 1;
+	return r;
+}
+
+
+/*
+ * handle_line()
+ *
+ * A line may hold several ';' chained commands, the replies to
+ * the queries in it go back as one line, ';' separated, the way
+ * the meter does it.
+ *
+ */
+void handle_line( struct glb *g, char *line ) {
+	char reply[REPLY_SIZE] = "";
+	size_t rlen = 0;
+	char *save = NULL;
+
+	for (char *c = strtok_r(line, ";", &save); c; c = strtok_r(NULL, ";", &save)) {
+		char one[REPLY_SIZE];
+		const char *a;
+
+		while (*c == ' ' || *c == ':') c++;
+		for (char *p = c; *p; p++) *p = toupper(*p);
+		if (!*c) continue;
+
+		g->commands++;
+		if (g->debug) fprintf(stderr,"%s:%d: '%s'\n", FL, c);
+
+		a = answer( g, c, one, sizeof(one) );
+		if (a && rlen < sizeof(reply) -1) {
+			rlen += snprintf(reply +rlen, sizeof(reply) -rlen, "%s%s", rlen ? ";" : "", a);
+		}
+	}
+
+	if (rlen) queue_reply( g, reply );
+}
+
+
+void read_commands( struct glb *g ) {
+	ssize_t r;
+
+	while ((r = read(g->master_fd, g->cmd +g->cmd_len, sizeof(g->cmd) -g->cmd_len -1)) > 0) {
+		char *start = g->cmd, *nl;
+
+		g->cmd_len += r;
+		g->cmd[g->cmd_len] = '\0';
+
+		while ((nl = strchr(start, '\n')) != NULL) {
+			*nl = '\0';
+			if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+			handle_line( g, start );
+			start = nl +1;
+		}
+
+		g->cmd_len -= start -g->cmd;
+		memmove(g->cmd, start, g->cmd_len);
+
+		/*
+		 * No terminator in a whole buffer's worth; it's not SCPI
+		 */
+		if (g->cmd_len >= sizeof(g->cmd) -1) g->cmd_len = 0;
+	}
+}
+
+
+/*
+ * flush_out()
+ *
+ * Writes every chunk that's due and arms the timer for the next
+ * one. A full pty (client not reading) leaves the rest queued
+ * and we try again shortly.
+ *
+ */
+void flush_out( struct glb *g, int tfd ) {
+	struct itimerspec its;
+	uint64_t now = now_us();
+
+	while (g->out_tail != g->out_head) {
+		struct chunk_s *c = &g->out[g->out_tail % OUT_CHUNKS];
+		ssize_t w;
+
+		if (c->due > now) break;
+
+		w = write(g->master_fd, c->d +c->sent, c->len -c->sent);
+		if (w < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				c->due = now +1000;
+				break;
+			}
+			if (g->debug) fprintf(stderr,"%s:%d: Write failed (%s)\n", FL, strerror(errno));
+			g->out_tail = g->out_head;
+			break;
+		}
+		c->sent += w;
+		g->bytes_out += w;
+		if (c->sent < c->len) {
+			c->due = now +1000;
+			break;
+		}
+		g->out_tail++;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (g->out_tail != g->out_head) {
+		uint64_t due = g->out[g->out_tail % OUT_CHUNKS].due;
+		uint64_t wait = due > now ? due -now : 1;
+
+		its.it_value.tv_sec = wait /1000000;
+		its.it_value.tv_nsec = (wait %1000000) *1000;
+	}
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+
+int watch_fd( int epfd, int fd, uint32_t src ) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = src;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+int main( int argc, char **argv ) {
+	struct glb g;
+	sigset_t ss;
+	int epfd, tfd, sfd;
+	int quit = 0;
+
+	init( &g );
+	parse_parameters( &g, argc, argv );
+	srand( g.seed );
+
+	if (open_pty( &g ) != 0) exit(1);
+
+	/*
+	 * The client finds us by whatever this prints
+	 */
+	fprintf(stdout,"%s\n", g.link_path ? g.link_path : g.slave_name);
+	fflush(stdout);
+
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	sigaddset(&ss, SIGTERM);
+	sigaddset(&ss, SIGHUP);
+	sigprocmask(SIG_BLOCK, &ss, NULL);
+	sfd = signalfd(-1, &ss, SFD_CLOEXEC);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	watch_fd( epfd, g.master_fd, SRC_PTY );
+	watch_fd( epfd, tfd, SRC_TIMER );
+	watch_fd( epfd, sfd, SRC_SIGNAL );
+
+	while (!quit) {
+		struct epoll_event evs[4];
+		int n = epoll_wait(epfd, evs, 4, -1);
+
+		for (int i = 0; i < n; i++) {
+			uint64_t count;
+			ssize_t r;
+
+			switch (evs[i].data.u32) {
+				case SRC_PTY: read_commands( &g ); break;
+				case SRC_TIMER: r = read(tfd, &count, sizeof(count)); (void)r; break;
+				case SRC_SIGNAL: quit = 1; break;
+			}
+		}
+		flush_out( &g, tfd );
+	}
+
+	if (g.debug) {
+		fprintf(stderr,"%lu commands, %lu replies (%lu fragmented, %lu with garbage), %lu bytes sent\n"
+				, g.commands, g.replies, g.fragments, g.garbage, g.bytes_out);
+	}
+
+	if (g.link_path) unlink(g.link_path);
+	close(g.slave_fd);
+	close(g.master_fd);
+
+	return 0;
+}